@@ -6,24 +6,97 @@
 #include "bespeckle.h"
 #include "effects.h"
 
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Effects stack (initially empty)
-#define EFFECTS_HEAP_SIZE 50
 #define EFFECT_UNUSED 0xffffffff
-Effect* effects = NULL;
+EffectStack effects;
 Effect effects_heap[EFFECTS_HEAP_SIZE]; //XXX
 
+// Stack that create/stop/msg packets apply to; changed by CMD_GROUP
+EffectStack* editing = &effects;
+
+// Stacks of sources 1 & up (source 0's is `effects`), the source of the packet being handled,
+// and what each source is editing while another one's packets are handled
+EffectStack source_stacks[NUM_SOURCES - 1];
+uint8_t active_source = 0;
+EffectStack* source_editing[NUM_SOURCES];
+
+// Per source: z-index for the next effect created with uid `pending_z_uid`, set by CMD_ZORDER
+bool_t pending_z_set[NUM_SOURCES];
+uint8_t pending_z_uid[NUM_SOURCES];
+uint8_t pending_z[NUM_SOURCES];
+
+LayerGroup groups[NUM_GROUPS];
+uint32_t frame_count = 0;
+
+// Admission control
+uint16_t frame_budget = 0;
+uint8_t budget_policy = BUDGET_REJECT;
+void (* report)(canpacket_t*) = NULL;
+
+// Power limiting
+uint16_t power_budget = 0;
+uint8_t power_release = POWER_RELEASE;
+uint8_t power_scale = POWER_FULL;
+
+typedef struct {
+    canpacket_t packet;
+    EffectStack* stack;
+#ifdef TRACE
+    TraceSpan* span;
+#endif
+} QueuedEffect;
+
+QueuedEffect admit_queue[ADMIT_QUEUE_LEN];
+uint8_t admit_queued = 0;
+
+// Per source, the fragmented transfer in progress: the heap slot being written, and which
+// fragments it has
+Effect* frag_slot[NUM_SOURCES];
+uint8_t frag_uid[NUM_SOURCES];
+uint8_t frag_mask[NUM_SOURCES];
+
+AutomationTrack tracks[NUM_TRACKS];
+
+// Scenes, and per source the one being recorded: its number + 1, 0 for none
+Scene scenes[NUM_SCENES];
+void (* scene_store)(uint8_t, const Scene*) = NULL;
+uint8_t recording[NUM_SOURCES];
+
+#ifdef TRACE
+// Packets being followed to the output
+TraceSpan trace_spans[TRACE_PENDING];
+uint32_t (* trace_clock)(void) = NULL;
+void (* trace_sink)(const TraceSpan*) = NULL;
+uint32_t trace_histogram[TRACE_STAGES][TRACE_BUCKETS];
+uint32_t trace_dropped = 0;
+// The span of the packet message() is applying
+TraceSpan* trace_current = NULL;
+#endif
+
+// Physical layout
+position_t pixel_map[PHYSICAL_LENGTH];
+uint8_t layout = LAYOUT_LINEAR;
+uint8_t layout_param = 0;
+
 void init_effects_heap(){
     for(int i = 0; i < EFFECTS_HEAP_SIZE; i++){
         free_effect(effects_heap+i);
     }
     effects_running = 0;
+    set_layout(layout, layout_param);
 }
 
 // Parameters
 uint8_t parameters[PARAM_LEN] = {0xff,0xff,0xff,0xff};
 
+// Palette (initially clear)
+rgba_t palette[PALETTE_SIZE];
+uint32_t palette_generation = 0;
+
 /* Begin color functions */
 rgb_t pack_rgba(rgba_t in){
     return ((in.r >> 3 << RGBA_R_SHIFT) & RGBA_R_MASK) | 
@@ -76,6 +149,56 @@ rgb_t filter_rgb(rgb_t color, uint8_t rf, uint8_t gf, uint8_t bf, uint8_t kf){
     return out;
 }
 
+/* Blend kernels
+ * Each kernel blends a whole layer onto the packed strip. Apart from BLEND_OVER they work
+ * on 5 bit channels: the mode picks a target value from the top & bottom channels, and
+ * the top alpha mixes from the bottom towards it. The loops are branch free so they vectorize.
+ */
+
+void blend_over(rgb_t* dst, const rgba_t* src, position_t n){
+    position_t i;
+    for(i = 0; i < n; i++){
+        dst[i] = mix_rgb(src[i], dst[i]);
+    }
+}
+
+#define BLEND_CHANNEL(d, s, a, mask, shift, f) \
+    (((((d & mask) >> shift) * (0xff - a) + f((s) >> 3, (d & mask) >> shift) * a) / 0xff) << shift)
+
+#define BLEND_KERNEL(name, f) \
+void name(rgb_t* dst, const rgba_t* src, position_t n){ \
+    position_t i; \
+    for(i = 0; i < n; i++){ \
+        uint16_t d = dst[i]; \
+        uint16_t a = src[i].a; \
+        dst[i] = RGB_EMPTY | \
+            BLEND_CHANNEL(d, src[i].r, a, RGBA_R_MASK, RGBA_R_SHIFT, f) | \
+            BLEND_CHANNEL(d, src[i].g, a, RGBA_G_MASK, RGBA_G_SHIFT, f) | \
+            BLEND_CHANNEL(d, src[i].b, a, RGBA_B_MASK, RGBA_B_SHIFT, f); \
+    } \
+}
+
+#define BLEND_F_ADD(t, b)      ((t) + (b) > 0x1f ? 0x1f : (t) + (b))
+#define BLEND_F_MULTIPLY(t, b) (((t) * (b)) / 0x1f)
+#define BLEND_F_SCREEN(t, b)   (0x1f - ((0x1f - (t)) * (0x1f - (b))) / 0x1f)
+#define BLEND_F_MAX(t, b)      ((t) > (b) ? (t) : (b))
+#define BLEND_F_MASK(t, b)     0
+
+BLEND_KERNEL(blend_add, BLEND_F_ADD)
+BLEND_KERNEL(blend_multiply, BLEND_F_MULTIPLY)
+BLEND_KERNEL(blend_screen, BLEND_F_SCREEN)
+BLEND_KERNEL(blend_max, BLEND_F_MAX)
+BLEND_KERNEL(blend_mask, BLEND_F_MASK)
+
+blend_kernel_t const blend_kernels[NUM_BLEND_MODES] = {
+    blend_over,     // BLEND_OVER
+    blend_add,      // BLEND_ADD
+    blend_multiply, // BLEND_MULTIPLY
+    blend_screen,   // BLEND_SCREEN
+    blend_max,      // BLEND_MAX
+    blend_mask,     // BLEND_MASK
+};
+
 rgba_t hsva_to_rgba(hsva_t in){
     // Convert HSVA to RGBA.  Hue from 0-254, sat, val, & alpha are 5 bit (0-31)
     // TODO: Optimize for the values we actually have
@@ -143,15 +266,22 @@ int32_t time_sub(tick_t end, tick_t start){
     return ((int32_t) end.tick - (int32_t) start.tick) * TICK_LENGTH + ((int32_t) end.frac -(int32_t)  start.frac);
 }
 
-tick_t clock = {0, 0};
+uint32_t recip(uint32_t d){
+    return ((uint32_t) 1 << RECIP_SHIFT) / d;
+}
 
-Effect* tick_all(Effect* eff, fractick_t ft, uint8_t beat){
-    // Send a tick event to every effect
-    // If ft is 0, check for deleted effects
-    // Return new top of stack
-    Effect* prev = NULL;
-    Effect* start = eff;
+uint32_t div_recip(uint32_t n, uint32_t d, uint32_t r){
+    // The estimate is never high, and low by at most one
+    uint32_t q = (n * r) >> RECIP_SHIFT;
+    if(n - q * d >= d){
+        q++;
+    }
+    return q;
+}
+
+tick_t clock = {0, 0};
 
+void advance_clock(fractick_t ft, uint8_t beat){
     if(beat){
         clock.tick++;
         clock.frac = 0;
@@ -161,163 +291,717 @@ Effect* tick_all(Effect* eff, fractick_t ft, uint8_t beat){
             clock.frac = ft;
         }
     }
+}
+
+void tick_all(EffectStack* stack, fractick_t ft, uint8_t beat){
+    // Send a tick event to every effect
+    // If ft is 0, check for deleted effects
+    advance_clock(ft, beat);
+    tick_list(stack, ft);
+}
+
+void tick_list(EffectStack* stack, fractick_t ft){
+    Effect* eff = stack->head;
+    Effect* next;
 
     while(eff){
-        if(eff->table->tick(eff, ft)){
-            if(prev != NULL){ // && start == eff
-                // In the middle/end
-                prev->next = eff->next;
-                free_effect(eff);
-                eff = prev->next;
-            }else{
-                // At the beginning
-                start = eff->next;
+        next = eff->next;
+        if(effect_tick(eff, ft)){
+            unlink_effect(stack, eff);
+            free_effect(eff);
+        }
+        eff = next;
+    }
+}
+
+void tick_groups(fractick_t ft){
+    uint8_t g;
+    for(g = 0; g < NUM_GROUPS; g++){
+        tick_list(&groups[g].effects, ft);
+    }
+}
+
+void admit_retry(void);
+void admit_clear(void);
+
+#ifdef TICK_BY_TYPE
+// Live effects grouped by table; type t is ticking[ticking_start[t]] up to ticking_start[t + 1]
+Effect* ticking[EFFECTS_HEAP_SIZE];
+uint8_t ticking_start[NUM_EFFECTS + 1];
+bool_t ticking_dirty = 1;
+
+void index_ticking(){
+    // Counting sort of the heap by table
+    uint8_t count[NUM_EFFECTS];
+    uint8_t t;
+    int i;
+
+    memset(count, 0, sizeof(count));
+    for(i = 0; i < EFFECTS_HEAP_SIZE; i++){
+        if(effects_heap[i].next != (Effect*) EFFECT_UNUSED && !is_frag_slot(effects_heap + i)){
+            count[effects_heap[i].table - effect_table]++;
+        }
+    }
+    ticking_start[0] = 0;
+    for(t = 0; t < NUM_EFFECTS; t++){
+        ticking_start[t + 1] = ticking_start[t] + count[t];
+        count[t] = ticking_start[t];
+    }
+    for(i = 0; i < EFFECTS_HEAP_SIZE; i++){
+        if(effects_heap[i].next != (Effect*) EFFECT_UNUSED && !is_frag_slot(effects_heap + i)){
+            ticking[count[effects_heap[i].table - effect_table]++] = effects_heap + i;
+        }
+    }
+    ticking_dirty = 0;
+}
+
+void tick_types(fractick_t ft){
+    bool_t stopped[EFFECTS_HEAP_SIZE];
+    bool_t any_stopped;
+    EffectStack* stack;
+    Effect* eff;
+    Effect* next;
+    uint8_t t;
+
+    if(ticking_dirty){
+        index_ticking();
+    }
+    memset(stopped, 0, sizeof(stopped));
+    any_stopped = effect_tick_types(ticking, ticking_start, ft, stopped);
+    // Unlinking changes no other effect's state, so it can wait until every tick is done
+    // Effects don't know their stack, so one walk over the stacks finds every stopped one
+    for(t = 0; any_stopped && t < NUM_STACKS; t++){
+        stack = stack_by_id(t);
+        for(eff = stack->head; eff; eff = next){
+            next = eff->next;
+            if(stopped[eff - effects_heap]){
+                unlink_effect(stack, eff);
                 free_effect(eff);
-                eff = start;
             }
-        }else{
-            prev = eff;
-            eff = eff->next;
         }
     }
-    return start;
 }
+#endif
 
-void compose_all(Effect* eff, rgb_t* strip){ 
-    // Compose a list of effects onto a strip
-    Effect* eff_head = eff; // keep reference to head of stack
+void tick_effects(fractick_t ft){
+#ifdef TICK_BY_TYPE
+    tick_types(ft);
+#else
+    uint8_t s;
+    for(s = 0; s < NUM_SOURCES; s++){
+        tick_list(source_stack(s), ft);
+    }
+    tick_groups(ft);
+#endif
+}
+
+void tick_engine(fractick_t ft, uint8_t beat){
+    advance_clock(ft, beat);
+    tick_effects(ft);
+#ifdef TRACE
+    trace_applied(trace_current);
+#endif
+    tick_automation();
+    admit_retry();
+}
+
+uint32_t hash_effects(Effect* eff){
+    // FNV-1a over everything that changes what a stack draws
+    uint32_t hash = 2166136261u;
+    uint8_t i;
+    // Palette effects draw from the palette, so any write to it counts as a change
+    hash = (hash ^ palette_generation) * 16777619u;
+    for(; eff; eff = eff->next){
+        hash = (hash ^ eff->table->eid) * 16777619u;
+        hash = (hash ^ eff->uid) * 16777619u;
+        hash = (hash ^ eff->blend) * 16777619u;
+        for(i = 0; i < eff->table->size; i++){
+            hash = (hash ^ eff->data[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+rgba_t over_rgba(rgba_t top, rgba_t bot){
+    // Alpha over that keeps the alpha channel, for rendering groups
+    rgba_t out;
+    uint16_t bot_a = bot.a * (0xff - top.a) / 0xff;
+    out.a = top.a + bot_a;
+    if(out.a == 0){
+        return out;
+    }
+    out.r = (top.r * top.a + bot.r * bot_a) / out.a;
+    out.g = (top.g * top.a + bot.g * bot_a) / out.a;
+    out.b = (top.b * top.a + bot.b * bot_a) / out.a;
+    return out;
+}
+
+void render_group(uint8_t g, tick_t now){
+    // Members are stacked with alpha over; the group's own layer carries the blend mode
+    const static rgba_t clear = {0,0,0,0};
+    LayerGroup* group = groups + g;
+    Effect* eff;
+    rgba_t layer[STRIP_LENGTH];
+    uint32_t hash;
     position_t i;
-    rgb_t px;
-    
-    for(i = 0; i < STRIP_LENGTH; i++, strip++){
-        px = RGB_EMPTY;
-        for(eff = eff_head; eff; eff = eff->next){
-            px = mix_rgb(eff->table->pixel(eff, i), px);
+    position_t lo;
+    position_t hi;
+    uint8_t x;
+
+    if(group->rendering || group->frame == frame_count){
+        // Already current for this frame, or a group containing itself
+        return;
+    }
+    group->frame = frame_count;
+    prepare_all(group->effects.head, now);
+    hash = hash_effects(group->effects.head);
+    if(group->valid && hash == group->hash){
+        return;
+    }
+
+    group->rendering = 1;
+    for(i = 0; i < STRIP_LENGTH; i++){
+        group->buffer[i] = clear;
+    }
+    for(eff = group->effects.head; eff; eff = eff->next){
+        for(x = 0; x < eff->num_extents; x++){
+            lo = eff->extents[x][0];
+            hi = eff->extents[x][1];
+            effect_layer(eff, layer, lo, hi);
+            for(i = lo; i < hi; i++){
+                group->buffer[i] = over_rgba(layer[i], group->buffer[i]);
+            }
+        }
+    }
+    group->rendering = 0;
+    group->hash = hash;
+    group->valid = 1;
+}
+
+void set_layout(uint8_t l, uint8_t param){
+    // Work out which logical pixel each physical pixel shows
+    // Every layout scales its segments to the full logical strip
+    uint16_t i;
+    uint16_t k;     // Position within the segment
+    uint16_t seg;   // Length of the segment
+    uint16_t row;
+
+    if(l >= NUM_LAYOUTS){
+        return;
+    }
+    layout = l;
+    layout_param = param;
+    for(i = 0; i < PHYSICAL_LENGTH; i++){
+        seg = PHYSICAL_LENGTH;
+        switch(l){
+            case LAYOUT_REVERSE:
+                k = PHYSICAL_LENGTH - 1 - i;
+            break;
+            case LAYOUT_MIRROR:
+                seg = (PHYSICAL_LENGTH + 1) / 2;
+                k = (i < seg) ? i : PHYSICAL_LENGTH - 1 - i;
+            break;
+            case LAYOUT_REPEAT:
+                seg = (PHYSICAL_LENGTH + (param ? param : 1) - 1) / (param ? param : 1);
+                k = i % seg;
+            break;
+            case LAYOUT_SERPENTINE:
+                row = param ? param : PHYSICAL_LENGTH;
+                k = i % row;
+                if((i / row) & 1){
+                    k = row - 1 - k;
+                }
+                k += (i / row) * row;
+                if(k >= PHYSICAL_LENGTH){
+                    // Short last row
+                    k = PHYSICAL_LENGTH - 1;
+                }
+            break;
+            case LAYOUT_LINEAR:
+            default:
+                k = i;
+            break;
+        }
+        pixel_map[i] = (uint32_t) k * STRIP_LENGTH / seg;
+    }
+}
+
+void add_extent(Effect* eff, int16_t lo, int16_t hi){
+    if(lo < 0){
+        lo = 0;
+    }
+    if(hi > STRIP_LENGTH){
+        hi = STRIP_LENGTH;
+    }
+    if(lo >= hi || eff->num_extents >= MAX_EXTENTS){
+        return;
+    }
+    eff->extents[eff->num_extents][0] = lo;
+    eff->extents[eff->num_extents][1] = hi;
+    eff->num_extents++;
+}
+
+void set_extent(Effect* eff, int16_t lo, int16_t hi){
+    eff->num_extents = 0;
+    add_extent(eff, lo, hi);
+}
+
+void prepare_all(Effect* eff, tick_t now){
+    // Let every effect derive its per-frame state for time `now`
+    for(; eff; eff = eff->next){
+        set_extent(eff, 0, STRIP_LENGTH);
+        effect_prepare(eff, now);
+    }
+}
+
+const FusedKernel* find_fused_kernel(Effect* eff){
+    // Look for a kernel whose layers match the stack exactly, bottom first
+    const FusedKernel* kernel;
+    Effect* e;
+    uint8_t n;
+
+    for(kernel = fused_kernels; kernel->layers; kernel++){
+        for(e = eff, n = 0; e && n < kernel->layers; e = e->next, n++){
+            // Kernels only know how to mix with BLEND_OVER
+            if(e->table->pixel != kernel->pixels[n] || e->blend != BLEND_OVER){
+                break;
+            }
+            // Kernels draw the whole strip, which would undo the savings of a narrower extent
+            if(e->num_extents != 1 || e->extents[0][0] != 0 || e->extents[0][1] != STRIP_LENGTH){
+                break;
+            }
+        }
+        if(e == NULL && n == kernel->layers){
+            return kernel;
         }
+    }
+    return NULL;
+}
+
+void compose_lists(Effect** heads, uint8_t n, rgb_t* strip, tick_t now){ 
+    // Compose lists of effects onto a strip, each on top of the last, as they appear at time `now`
+    Effect* eff_head = NULL; // the only list with effects, if there is one
+    Effect* eff;
+    const FusedKernel* kernel = NULL;
+    rgb_t frame[STRIP_LENGTH];
+    rgba_t layer[STRIP_LENGTH];
+    position_t i;
+    position_t lo;
+    position_t hi;
+    uint8_t x;
+    uint8_t l;
+    uint8_t lists = 0;
+    uint32_t power = 0;
+    rgb_t color;
+
+    frame_count++;
+    for(l = 0; l < n; l++){
+        if(heads[l]){
+            prepare_all(heads[l], now);
+            eff_head = heads[l];
+            lists++;
+        }
+    }
+
+    if(lists == 1){
+        kernel = find_fused_kernel(eff_head);
+    }
+    if(kernel){
+        kernel->compose(eff_head, frame);
+    }else{
+        // Generic path; render one layer at a time, then blend it by its mode
+        // Only the extents of each layer are rendered & blended; everywhere else it is clear
+        for(i = 0; i < STRIP_LENGTH; i++){
+            frame[i] = RGB_EMPTY;
+        }
+        for(l = 0; l < n; l++){
+            for(eff = heads[l]; eff; eff = eff->next){
+                for(x = 0; x < eff->num_extents; x++){
+                    lo = eff->extents[x][0];
+                    hi = eff->extents[x][1];
+                    effect_layer(eff, layer, lo, hi);
+                    blend_kernels[eff->blend](frame + lo, layer + lo, hi - lo);
+                }
+            }
+        }
+    }
+    
+    for(i = 0; i < STRIP_LENGTH; i++){
         // Apply color correction
-        px = filter_rgb(px, parameters[0], parameters[1], parameters[2], parameters[3]);
+        frame[i] = filter_rgb(frame[i], parameters[0], parameters[1], parameters[2], parameters[3]);
+    }
+    for(i = 0; i < PHYSICAL_LENGTH; i++, strip++){
+        // Scatter each logical pixel to the physical pixels showing it
         // Buffer pixel to prevent flicker while sending pixel buffer
         // Now the failure mode is tearing
-        *strip = px;
+        color = frame[pixel_map[i]];
+        *strip = color;
+        power += ((color & RGBA_R_MASK) >> RGBA_R_SHIFT) +
+                 ((color & RGBA_G_MASK) >> RGBA_G_SHIFT) +
+                 ((color & RGBA_B_MASK) >> RGBA_B_SHIFT);
+    }
+    power_limit(strip - PHYSICAL_LENGTH, power);
+#ifdef TRACE
+    trace_composed();
+#endif
+}
+
+void power_limit(rgb_t* strip, uint32_t power){
+    // Scaling every channel down rounds down, so the scaled frame draws no more than the budget
+    uint32_t fit = POWER_FULL;
+    position_t i;
+    if(!power_budget){
+        power_scale = POWER_FULL;
+        return;
     }
+    if(power > power_budget){
+        fit = (uint32_t) power_budget * POWER_FULL / power;
+    }
+    // Drop to the fit at once, but climb back by at most `power_release`
+    if(fit > (uint32_t) power_scale + power_release){
+        fit = power_scale + power_release;
+    }
+    power_scale = fit;
+    if(power_scale == POWER_FULL){
+        return;
+    }
+    for(i = 0; i < PHYSICAL_LENGTH; i++){
+        strip[i] = filter_rgb(strip[i], 0xff, 0xff, 0xff, power_scale);
+    }
+}
+
+void compose_at(Effect* eff, rgb_t* strip, tick_t now){ 
+    compose_lists(&eff, 1, strip, now);
+}
+
+void compose_all(Effect* eff, rgb_t* strip){ 
+    compose_at(eff, strip, clock);
 }
 
 void populate_strip(rgb_t* strip){
-    compose_all(effects, strip);
+    // Every source's stack, in order
+    Effect* heads[NUM_SOURCES];
+    uint8_t s;
+    for(s = 0; s < NUM_SOURCES; s++){
+        heads[s] = source_stack(s)->head;
+    }
+    compose_lists(heads, NUM_SOURCES, strip, clock);
 }
 
-Effect* msg_all(Effect* eff, canpacket_t* data){
-    // Pass on canpacket data to matching effect
-    // Return new top of stack
-    Effect* prev = NULL;
-    Effect* start = eff;
+/* Output stage */
 
-    while(eff){
-        if(eff->uid == data->uid){ // Match uid
-            if(eff->table->msg(eff, data)){ // Send message
-                // The effect asked to quit
-                if(prev != NULL){
-                    // In the middle/end
-                    prev->next = eff->next;
-                    free_effect(eff);
-                    eff = prev->next;
-                }else{
-                    // At the beginning
-                    start = eff->next;
-                    free_effect(eff);
-                    eff = start;
-                }
+rgb_t sent[PHYSICAL_LENGTH];
+bool_t sent_valid = 0;
+
+void output_invalidate(){
+    sent_valid = 0;
+}
+
+uint16_t output_frame(const rgb_t* strip, span_sink_t sink){
+    uint16_t changed = 0;
+    uint16_t start = 0;
+    uint16_t end = 0; // One past the last changed pixel of the open span
+    bool_t open = 0;
+    uint16_t i;
+
+    if(!sent_valid){
+        memcpy(sent, strip, sizeof(sent));
+        sent_valid = 1;
+        if(sink){
+            sink(0, PHYSICAL_LENGTH, sent);
+        }
+        return PHYSICAL_LENGTH;
+    }
+
+    for(i = 0; i < PHYSICAL_LENGTH; i++){
+        if(strip[i] == sent[i]){
+            continue;
+        }
+        sent[i] = strip[i];
+        changed++;
+        if(open && i - end >= SPAN_MERGE_GAP){
+            // Too far from the open span; send it & start another
+            if(sink){
+                sink(start, end - start, sent + start);
             }
-            return start;
-        }else{
-            prev = eff;
-            eff = eff->next;
+            open = 0;
         }
+        if(!open){
+            start = i;
+            open = 1;
+        }
+        end = i + 1;
+    }
+    if(open && sink){
+        sink(start, end - start, sent + start);
     }
-    return start;
+    return changed;
 }
 
-void pop_effect(Effect** stack, uint8_t uid){
-    Effect * _stack = *stack;
-    Effect * last_stack = NULL;
-    for(; _stack != NULL; last_stack = _stack, _stack = _stack->next){
-        if(_stack->uid == uid){
-            if(last_stack == NULL){
-                *stack = _stack->next;
-            }else{
-                last_stack->next = _stack->next;
-            }
-            free_effect(_stack);
-            return;
+void msg_all(EffectStack* stack, canpacket_t* data){
+    // Pass on canpacket data to matching effect
+    Effect* eff = find_effect(stack, data->uid);
+
+    if(eff && eff->table->msg(eff, data)){ // Send message
+        // The effect asked to quit
+        unlink_effect(stack, eff);
+        free_effect(eff);
+    }
+}
+
+Effect* find_effect(EffectStack* stack, uint8_t uid){
+    return stack->by_uid[uid] ? effects_heap + stack->by_uid[uid] - 1 : NULL;
+}
+
+EffectStack* source_stack(uint8_t s){
+    return s ? source_stacks + s - 1 : &effects;
+}
+
+EffectStack* stack_by_id(uint8_t id){
+    return (id < NUM_GROUPS) ? &groups[id].effects : source_stack(id - NUM_GROUPS);
+}
+
+uint8_t stack_id(EffectStack* stack){
+    uint8_t id;
+    for(id = 0; id < NUM_STACKS - 1; id++){
+        if(stack_by_id(id) == stack){
+            break;
         }
     }
+    return id;
 }
 
-void push_effect(Effect** stack, Effect* eff){
-    // XXX Clean me :(
-    Effect * _stack = *stack;
-    Effect * last_stack = NULL;
-    // Add to end of stack
-    if(*stack == NULL){
-        // If the stack was empty, that was easy
-        *stack = eff;
+void message_from(uint8_t s, canpacket_t* data){
+    uint8_t outer = active_source;
+    if(s >= NUM_SOURCES){
         return;
     }
+    // Switch to the source's own editing stack for the packet, then back
+    source_editing[outer] = editing;
+    active_source = s;
+    editing = source_editing[s] ? source_editing[s] : source_stack(s);
+    message(data);
+    source_editing[s] = editing;
+    active_source = outer;
+    editing = source_editing[outer];
+}
 
-    for(; _stack; _stack = _stack->next){
-        // Loop until we get to the end of the stack, or we find one to replace
-        if(_stack->uid == eff->uid){
-            // Existing stack element with same uid; remove it
-            free_effect(_stack);
-            if(last_stack == NULL){
-                *stack = eff;
-            }else{
-                last_stack->next = eff;
-            }
-            return;
+void pop_effect(EffectStack* stack, uint8_t uid){
+    Effect* eff = find_effect(stack, uid);
+    if(eff){
+        unlink_effect(stack, eff);
+        free_effect(eff);
+    }
+}
+
+void push_effect(EffectStack* stack, Effect* eff){
+    // Existing stack element with same uid; remove it
+    pop_effect(stack, eff->uid);
+    link_effect(stack, eff);
+}
+
+uint8_t find_level(EffectStack* stack, uint8_t z){
+    // Binary search for the first z level at or above `z`
+    uint8_t lo = 0;
+    uint8_t hi = stack->levels;
+    uint8_t mid;
+
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(stack->z[mid] < z){
+            lo = mid + 1;
+        }else{
+            hi = mid;
         }
-        last_stack = _stack;
     }
-    last_stack->next = eff;
+    return lo;
+}
+
+void link_effect(EffectStack* stack, Effect* eff){
+    uint8_t i = find_level(stack, eff->z);
+    Effect* below;
+
+    if(i < stack->levels && stack->z[i] == eff->z){
+        below = effects_heap + stack->tail[i];
+    }else{
+        // Start a new level, on top of the levels below it
+        memmove(stack->z + i + 1, stack->z + i, stack->levels - i);
+        memmove(stack->tail + i + 1, stack->tail + i, stack->levels - i);
+        stack->levels++;
+        stack->z[i] = eff->z;
+        below = i ? effects_heap + stack->tail[i - 1] : NULL;
+    }
+    stack->tail[i] = eff - effects_heap;
+
+    eff->prev = below;
+    eff->next = below ? below->next : stack->head;
+    if(eff->next){
+        eff->next->prev = eff;
+    }
+    if(below){
+        below->next = eff;
+    }else{
+        stack->head = eff;
+    }
+    stack->by_uid[eff->uid] = eff - effects_heap + 1;
+#ifdef TICK_BY_TYPE
+    ticking_dirty = 1;
+#endif
+}
+
+void unlink_effect(EffectStack* stack, Effect* eff){
+    uint8_t i = find_level(stack, eff->z);
+
+    if(effects_heap + stack->tail[i] == eff){
+        if(eff->prev && eff->prev->z == eff->z){
+            stack->tail[i] = eff->prev - effects_heap;
+        }else{
+            // Last one at this z
+            stack->levels--;
+            memmove(stack->z + i, stack->z + i + 1, stack->levels - i);
+            memmove(stack->tail + i, stack->tail + i + 1, stack->levels - i);
+        }
+    }
+    if(eff->prev){
+        eff->prev->next = eff->next;
+    }else{
+        stack->head = eff->next;
+    }
+    if(eff->next){
+        eff->next->prev = eff->prev;
+    }
+    stack->by_uid[eff->uid] = 0;
+}
+
+void set_z(EffectStack* stack, Effect* eff, uint8_t z){
+    unlink_effect(stack, eff);
+    eff->z = z;
+    link_effect(stack, eff);
+}
+
+void replace_effect(EffectStack* stack, Effect* old, Effect* eff){
+    uint8_t i = find_level(stack, old->z);
+
+    // Everything but the data carries over
+    memcpy(eff, old, offsetof(Effect, data));
+    if(eff->prev){
+        eff->prev->next = eff;
+    }else{
+        stack->head = eff;
+    }
+    if(eff->next){
+        eff->next->prev = eff;
+    }
+    if(effects_heap + stack->tail[i] == old){
+        stack->tail[i] = eff - effects_heap;
+    }
+    stack->by_uid[eff->uid] = eff - effects_heap + 1;
+    old->next = (Effect*) EFFECT_UNUSED;
+#ifdef TICK_BY_TYPE
+    ticking_dirty = 1;
+#endif
 }
 
 void free_effect(Effect* eff){
     // Deallocate space for effect
     //free(eff);
     eff->next = (Effect*) EFFECT_UNUSED;
+#ifdef TICK_BY_TYPE
+    ticking_dirty = 1;
+#endif
     if(effects_running >= 1){
         effects_running--;
     }
 }
 
+Effect* alloc_effect(){
+    int i;
+    for(i = 0; i < EFFECTS_HEAP_SIZE; i++){
+        if(effects_heap[i].next == (Effect*) EFFECT_UNUSED){
+            return effects_heap + i;
+        }
+    }
+    return NULL;
+}
+
+const EffectTable* find_effect_table(uint8_t eid){
+    int i;
+    for(i = 0; i < NUM_EFFECTS; i++){
+        if(effect_table[i].eid == eid){
+            return effect_table + i;
+        }
+    }
+    return NULL;
+}
+
+void clear_stack(EffectStack* stack){
+    Effect* e;
+    while(stack->head){
+        e = stack->head;
+        stack->head = e->next;
+        free_effect(e);
+    }
+    stack->levels = 0;
+    memset(stack->by_uid, 0, sizeof(stack->by_uid));
+}
+
 void message(canpacket_t* data){
     Effect* e;
+    Scene* scene;
+    int i;
+#ifdef TRACE
+    TraceSpan* outer = trace_current;
+#endif
+    if(recording[active_source] && data->cmd != CMD_SYNC && data->cmd != CMD_TICK && data->cmd != CMD_SCENE){
+        // Keep it for later instead; only the recording source's packets
+        scene = scenes + recording[active_source] - 1;
+        if(scene->count < SCENE_PACKETS){
+            scene->packets[scene->count++] = *data;
+        }
+        return;
+    }
+#ifdef TRACE
+    trace_current = trace_ingest(data);
+#endif
     if(data->cmd & FLAG_CMD){
         if(data->cmd & FLAG_CMD_MSG){
-            effects = msg_all(effects, data);
+            msg_all(editing, data);
+        }else if((data->cmd & ~FRAG_SEQ_MASK) == CMD_FRAG){
+            frag_write(data);
         }else{
             switch(data->cmd){
                 case CMD_SYNC:
-                    effects = tick_all(effects, data->uid, 0);
+                    tick_engine(data->uid, 0);
                 break;
                 case CMD_TICK:
-                    effects = tick_all(effects, data->uid, 1);
+                    tick_engine(data->uid, 1);
                 break;
                 case CMD_MSG:
-                    effects = msg_all(effects, data);
+                    msg_all(editing, data);
                 break;
                 case CMD_STOP:
-                    pop_effect(&effects, data->uid);
+                    pop_effect(editing, data->uid);
                 break;
                 case CMD_RESET:
                 case CMD_REBOOT:
-                    // Reset strip, remove all effects
-                    while(effects){
-                        e = effects;
-                        effects = e->next;
-                        free_effect(e);
+                    // Reset strip, remove all effects, of every source
+                    for(i = 0; i < NUM_STACKS; i++){
+                        clear_stack(stack_by_id(i));
+                    }
+                    for(i = 0; i < NUM_GROUPS; i++){
+                        groups[i].valid = 0;
+                    }
+                    for(i = 0; i < NUM_SOURCES; i++){
+                        source_editing[i] = source_stack(i);
+                        pending_z_set[i] = 0;
+                        recording[i] = 0;
+                        frag_abort(i);
+                    }
+                    editing = source_stack(active_source);
+                    admit_clear();
+                    for(i = 0; i < NUM_TRACKS; i++){
+                        tracks[i].kind = AUTO_OFF;
                     }
-                    int i;
                     for(i = 0; i < PARAM_LEN; i++){
                         parameters[i] = 0xff;
                     }
@@ -330,38 +1014,878 @@ void message(canpacket_t* data){
                         parameters[data->uid] = data->data[0];
                     }
                 break;
+                case CMD_BUDGET:
+                    budget_policy = data->uid;
+                    frame_budget = data->data[0] | (data->data[1] << 8);
+                break;
+                case CMD_POWER:
+                    power_budget = data->data[0] | (data->data[1] << 8);
+                    power_release = data->data[2] ? data->data[2] : POWER_RELEASE;
+                break;
+                case CMD_PRIORITY:
+                    e = find_effect(editing, data->uid);
+                    if(e){
+                        e->priority = data->data[0];
+                    }
+                break;
+                case CMD_ZORDER:
+                    // Restack an effect, or place the next one created with this uid
+                    e = find_effect(editing, data->uid);
+                    if(e){
+                        set_z(editing, e, data->data[0]);
+                    }else{
+                        pending_z_set[active_source] = 1;
+                        pending_z_uid[active_source] = data->uid;
+                        pending_z[active_source] = data->data[0];
+                    }
+                break;
+                case CMD_FRAG_COMMIT:
+                    frag_commit(data);
+                break;
+                case CMD_AUTO:
+                    auto_message(data);
+                break;
+                case CMD_SCENE:
+                    scene_message(data);
+                break;
+                case CMD_BLEND:
+                    // Set how an effect is blended onto the layers below it
+                    // Group members are always stacked with alpha over, so groups refuse it
+                    e = find_effect(editing, data->uid);
+                    if(e && data->data[0] < NUM_BLEND_MODES && stack_id(editing) >= NUM_GROUPS){
+                        e->blend = data->data[0];
+                    }
+                break;
+                case CMD_LAYOUT:
+                    set_layout(data->uid, data->data[0]);
+                break;
+                case CMD_PALETTE:
+                    // Write a run of entries, stopping at the end of the palette
+                    i = data->uid;
+                    do{
+                        memcpy(palette + i, data->data, sizeof(rgba_t));
+                        i++;
+                    }while(i < PALETTE_SIZE && i < data->uid + data->data[4]);
+                    palette_generation++;
+                break;
+                case CMD_GROUP:
+                    if(data->data[0] == GROUP_END || data->uid >= NUM_GROUPS){
+                        editing = source_stack(active_source);
+                    }else if(data->data[0] == GROUP_SELECT){
+                        editing = &groups[data->uid].effects;
+                    }else if(data->data[0] == GROUP_CLEAR){
+                        clear_stack(&groups[data->uid].effects);
+                        groups[data->uid].valid = 0;
+                    }
+                break;
                 default:
                 break;
             }
         }
     }else{
-        int i;
         for(i = 0; i < NUM_EFFECTS; i++){
             if(effect_table[i].eid == data->cmd){
-                // Remove effect with the same uid
-                pop_effect(&effects, data->uid);
-                // Found a match. Attempt to malloc
-                // TODO: this might be 1-4 bytes larger than nessassary? 
-                //Effect* eff = malloc(sizeof(Effect) + effect_table[i].size);
-                Effect* eff = NULL;
-                for(int i = 0; i < EFFECTS_HEAP_SIZE; i++){
-                    if(effects_heap[i].next == (Effect*) EFFECT_UNUSED){
-                        eff = effects_heap + i;
-                        break;
-                    }
-                }
-                if(eff == NULL){
-                    // malloc failed! :(
-                    return;
+                create_effect(editing, effect_table + i, data, NULL);
+            }
+        }
+    }
+#ifdef TRACE
+    // Everything else was applied in place above
+    trace_applied(trace_current);
+    trace_current = outer;
+#endif
+    admit_retry();
+}
+
+/* Admission control */
+
+uint16_t effect_cost(Effect* eff){
+    return eff->table->cost + (eff->blend != BLEND_OVER ? 1 : 0);
+}
+
+uint16_t stack_cost(Effect* eff){
+    uint16_t cost = 0;
+    for(; eff; eff = eff->next){
+        cost += effect_cost(eff);
+    }
+    return cost;
+}
+
+uint16_t engine_cost(){
+    uint16_t cost = 0;
+    uint8_t id;
+    for(id = 0; id < NUM_STACKS; id++){
+        cost += stack_cost(stack_by_id(id)->head);
+    }
+    return cost;
+}
+
+void report_admission(uint8_t uid, uint8_t decision, uint8_t evicted, uint16_t cost){
+    canpacket_t out = {CMD_REPORT, uid, {decision, evicted, cost & 0xff, cost >> 8, frame_budget & 0xff, frame_budget >> 8}};
+    if(report && frame_budget){
+        report(&out);
+    }
+}
+
+EffectStack* find_victim(Effect* keep, uint8_t priority, Effect** victim){
+    // Find the lowest priority layer (lowest in the stack on ties) that is no more important
+    // than `priority`, other than `keep`; returns its stack
+    EffectStack* stack = NULL;
+    EffectStack* s;
+    Effect* eff;
+    uint8_t id;
+
+    *victim = NULL;
+    for(id = 0; id < NUM_STACKS; id++){
+        s = stack_by_id(id);
+        for(eff = s->head; eff; eff = eff->next){
+            if(eff != keep && eff->priority <= priority && (*victim == NULL || eff->priority < (*victim)->priority)){
+                *victim = eff;
+                stack = s;
+            }
+        }
+    }
+    return stack;
+}
+
+uint16_t evictable_cost(Effect* keep, uint8_t priority){
+    // Total cost of every layer find_victim could pick
+    uint16_t cost = 0;
+    Effect* eff;
+    uint8_t id;
+    for(id = 0; id < NUM_STACKS; id++){
+        for(eff = stack_by_id(id)->head; eff; eff = eff->next){
+            if(eff != keep && eff->priority <= priority){
+                cost += effect_cost(eff);
+            }
+        }
+    }
+    return cost;
+}
+
+void create_effect(EffectStack* stack, const EffectTable* table, canpacket_t* data, Effect* slot){
+    Effect* old = find_effect(stack, data->uid);
+    Effect* victim;
+    EffectStack* victim_stack;
+    Effect* eff;
+    uint8_t z = old ? old->z : Z_DEFAULT;
+    // The effect with the same uid is replaced, so it doesn't count
+    uint16_t cost = engine_cost() - (old ? effect_cost(old) : 0);
+
+    if(frame_budget && cost + table->cost > frame_budget){
+        if(budget_policy == BUDGET_QUEUE && admit_queued < ADMIT_QUEUE_LEN && slot == NULL){
+            admit_queue[admit_queued].packet = *data;
+            admit_queue[admit_queued].stack = stack;
+#ifdef TRACE
+            // Applied when it is admitted
+            admit_queue[admit_queued].span = trace_current;
+            if(trace_current){
+                trace_current->state = SPAN_QUEUED;
+            }
+#endif
+            admit_queued++;
+            report_admission(data->uid, ADMIT_QUEUED, 0, cost);
+            return;
+        }
+        // Only evict when that frees enough; otherwise the newcomer is rejected below
+        if(budget_policy == BUDGET_EVICT && cost - evictable_cost(old, PRIORITY_DEFAULT) + table->cost <= frame_budget){
+            while(cost + table->cost > frame_budget){
+                victim_stack = find_victim(old, PRIORITY_DEFAULT, &victim);
+                cost -= effect_cost(victim);
+                report_admission(data->uid, ADMIT_EVICTED, victim->uid, cost);
+                pop_effect(victim_stack, victim->uid);
+            }
+        }
+        if(cost + table->cost > frame_budget){
+            if(slot){
+                slot->next = (Effect*) EFFECT_UNUSED;
+            }
+            report_admission(data->uid, ADMIT_REJECTED, 0, cost);
+            return;
+        }
+    }
+
+    // Remove effect with the same uid
+    pop_effect(stack, data->uid);
+    // Found a match. Attempt to malloc
+    // TODO: this might be 1-4 bytes larger than nessassary? 
+    //Effect* eff = malloc(sizeof(Effect) + effect_table[i].size);
+    eff = slot ? slot : alloc_effect();
+    if(eff == NULL){
+        // malloc failed! :(
+        report_admission(data->uid, ADMIT_REJECTED, 0, cost);
+        return;
+    }
+    // Setup effect; add to stack
+    eff->uid = data->uid;
+    eff->table = (EffectTable*) table;
+    eff->blend = BLEND_OVER;
+    eff->priority = PRIORITY_DEFAULT;
+    eff->z = z;
+    if(pending_z_set[active_source] && pending_z_uid[active_source] == data->uid){
+        eff->z = pending_z[active_source];
+        pending_z_set[active_source] = 0;
+    }
+    eff->start = clock;
+    table->setup(eff, data);
+    eff->next=NULL;
+    push_effect(stack, eff);
+    effects_running++;
+#ifdef TRACE
+    trace_applied(trace_current);
+#endif
+    report_admission(data->uid, ADMIT_ACCEPTED, 0, cost + table->cost);
+}
+
+void admit_retry(){
+    // Create queued effects, oldest first, while they fit in the budget
+    const EffectTable* table;
+    QueuedEffect* q = admit_queue;
+#ifdef TRACE
+    TraceSpan* outer = trace_current;
+#endif
+
+    while(admit_queued){
+        table = find_effect_table(q->packet.cmd);
+        if(frame_budget && engine_cost() + table->cost > frame_budget){
+            return;
+        }
+#ifdef TRACE
+        // Stamped by create_effect, or here if it was rejected after all
+        trace_current = q->span;
+        trace_dequeue(q->span);
+        create_effect(q->stack, table, &q->packet, NULL);
+        trace_applied(q->span);
+        trace_current = outer;
+#else
+        create_effect(q->stack, table, &q->packet, NULL);
+#endif
+        admit_queued--;
+        memmove(admit_queue, admit_queue + 1, admit_queued * sizeof(QueuedEffect));
+    }
+}
+
+void admit_clear(){
+    // Drop every queued effect
+#ifdef TRACE
+    while(admit_queued){
+        admit_queued--;
+        trace_dequeue(admit_queue[admit_queued].span);
+        trace_applied(admit_queue[admit_queued].span);
+    }
+#endif
+    admit_queued = 0;
+}
+
+/* Fragmented transfers */
+
+bool_t is_frag_slot(Effect* eff){
+    // Whether a source's transfer is writing this slot
+    uint8_t s;
+    for(s = 0; s < NUM_SOURCES; s++){
+        if(frag_slot[s] == eff){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void frag_abort(uint8_t s){
+    // Drop source s's transfer in progress & give back its slot
+    if(frag_slot[s]){
+        frag_slot[s]->next = (Effect*) EFFECT_UNUSED;
+        frag_slot[s] = NULL;
+    }
+    frag_mask[s] = 0;
+}
+
+void frag_write(canpacket_t* data){
+    uint8_t seq = data->cmd & FRAG_SEQ_MASK;
+    uint8_t offset = seq * CAN_DATA_SIZE;
+    uint8_t len = CAN_DATA_SIZE;
+    uint8_t s = active_source;
+    Effect* slot;
+
+    if(frag_slot[s] && frag_uid[s] != data->uid){
+        frag_abort(s);
+    }
+    if(frag_slot[s] == NULL){
+        frag_slot[s] = alloc_effect();
+        if(frag_slot[s] == NULL){
+            return;
+        }
+        // Taken, but not in any stack until the commit
+        frag_slot[s]->next = NULL;
+        frag_uid[s] = data->uid;
+        frag_mask[s] = 0;
+        memset(frag_slot[s]->data, 0x00, sizeof(frag_slot[s]->data));
+    }
+    slot = frag_slot[s];
+    if(offset >= sizeof(slot->data)){
+        return;
+    }
+    if(offset + len > sizeof(slot->data)){
+        len = sizeof(slot->data) - offset;
+    }
+    memcpy(slot->data + offset, data->data, len);
+    frag_mask[s] |= 1 << seq;
+}
+
+void frag_commit(canpacket_t* data){
+    const EffectTable* table = find_effect_table(data->data[0]);
+    canpacket_t setup = {CMD_FRAG_COMMIT, data->uid, {0}};
+    uint8_t s = active_source;
+    Effect* eff = frag_slot[s];
+    Effect* old;
+    uint8_t needed;
+
+    if(eff == NULL || frag_uid[s] != data->uid || table == NULL){
+        frag_abort(s);
+        return;
+    }
+    // Every fragment that covers the effect's data must have arrived
+    needed = (1 << ((table->size + CAN_DATA_SIZE - 1) / CAN_DATA_SIZE)) - 1;
+    if((frag_mask[s] & needed) != needed){
+        frag_abort(s);
+        return;
+    }
+    frag_slot[s] = NULL;
+    frag_mask[s] = 0;
+    memcpy(setup.data, eff->data, CAN_DATA_SIZE);
+
+    if(data->data[1] & FRAG_UPDATE){
+        old = find_effect(editing, data->uid);
+        if(old == NULL || old->table != table){
+            eff->next = (Effect*) EFFECT_UNUSED;
+            return;
+        }
+        replace_effect(editing, old, eff);
+        // Derive everything else from the new data, as a create would; the start is kept
+        table->setup(eff, &setup);
+        return;
+    }
+    create_effect(editing, table, &setup, eff);
+}
+
+/* Automation */
+
+void auto_message(canpacket_t* data){
+    AutomationTrack* track;
+    Keyframe* key;
+
+    if(data->uid >= NUM_TRACKS){
+        return;
+    }
+    track = tracks + data->uid;
+    switch(data->data[0]){
+        case AUTO_BIND:
+            if(data->data[1] != AUTO_EFFECT && data->data[1] != AUTO_PARAM){
+                return;
+            }
+            track->kind = data->data[1];
+            track->uid = data->data[2];
+            track->offset = data->data[3];
+            track->count = 0;
+            track->start = clock;
+            track->group = stack_id(editing);
+        break;
+        case AUTO_KEY:
+            if(track->kind == AUTO_OFF || track->count == AUTO_KEYS || data->data[5] >= NUM_CURVES){
+                return;
+            }
+            key = track->keys + track->count;
+            key->at = (data->data[1] | (data->data[2] << 8)) * TICK_LENGTH + data->data[3];
+            if(track->count && key->at < key[-1].at){
+                return;
+            }
+            key->value = data->data[4];
+            key->curve = data->data[5];
+            track->count++;
+        break;
+        case AUTO_STOP:
+            track->kind = AUTO_OFF;
+        break;
+    }
+}
+
+uint8_t auto_value(AutomationTrack* track, int32_t now, bool_t* done){
+    // Value of a track `now` fracticks after it was bound
+    Keyframe* key = track->keys;
+    Keyframe* last = track->keys + track->count - 1;
+    uint32_t f;
+
+    *done = 0;
+    for(; key < last && (int32_t) key[1].at <= now; key++);
+    if(key == last){
+        *done = (int32_t) key->at <= now;
+        return key->value;
+    }
+    if(now <= (int32_t) key->at || key->curve == CURVE_STEP){
+        return key->value;
+    }
+    // Fraction of the way to the next key, out of 256
+    f = ((uint32_t) (now - key->at) << 8) / (key[1].at - key->at);
+    if(key->curve == CURVE_EASE){
+        f = (f * f * (3 * 256 - 2 * f)) >> 16;
+    }
+    return key->value + (((int32_t) key[1].value - key->value) * (int32_t) f) / 256;
+}
+
+void tick_automation(){
+    AutomationTrack* track;
+    Effect* eff;
+    int32_t now;
+    uint8_t value;
+    bool_t done;
+
+    for(track = tracks; track < tracks + NUM_TRACKS; track++){
+        if(track->kind == AUTO_OFF || track->count == 0){
+            continue;
+        }
+        now = time_sub(clock, track->start);
+        if(now < (int32_t) track->keys[0].at){
+            continue;
+        }
+        value = auto_value(track, now, &done);
+        if(track->kind == AUTO_PARAM){
+            if(track->uid < PARAM_LEN){
+                parameters[track->uid] = value;
+            }
+        }else{
+            eff = find_effect(stack_by_id(track->group), track->uid);
+            if(eff == NULL || track->offset >= eff->table->size){
+                // The effect is gone
+                done = 1;
+            }else if(eff->data[track->offset] != value){
+                eff->data[track->offset] = value;
+                // Keep reciprocals, end times & the like in step with the new value
+                eff->table->derive(eff);
+            }
+        }
+        if(done){
+            track->kind = AUTO_OFF;
+        }
+    }
+}
+
+/* Scenes */
+
+void scene_message(canpacket_t* data){
+    Scene* scene;
+    uint8_t g;
+
+    if(data->uid >= NUM_SCENES){
+        return;
+    }
+    scene = scenes + data->uid;
+    switch(data->data[0]){
+        case SCENE_RECORD:
+            recording[active_source] = data->uid + 1;
+            scene->count = 0;
+        break;
+        case SCENE_END:
+            if(recording[active_source] == data->uid + 1 && scene_store){
+                scene_store(data->uid, scene);
+            }
+            recording[active_source] = 0;
+        break;
+        case SCENE_PLAY:
+            if(recording[active_source]){
+                // Not while recording: the scene could contain itself
+                return;
+            }
+            if(data->data[1] & SCENE_REPLACE){
+                // The groups, & this source's own stack
+                clear_stack(source_stack(active_source));
+                for(g = 0; g < NUM_GROUPS; g++){
+                    clear_stack(&groups[g].effects);
+                    groups[g].valid = 0;
                 }
-                // Setup effect; add to stack
-                eff->uid = data->uid;
-                eff->table = (EffectTable*)(effect_table+i);
-                effect_table[i].setup(eff, data);
-                eff->next=NULL;
-                push_effect(&effects, eff);
-                effects_running++;
+                editing = source_stack(active_source);
+            }
+            message_batch(scene->packets, scene->count);
+        break;
+        case SCENE_ERASE:
+            scene->count = 0;
+        break;
+    }
+}
+
+/* Tracing */
+
+#ifdef TRACE
+TraceSpan* trace_ingest(canpacket_t* data){
+    uint8_t i;
+    if(!trace_clock){
+        return NULL;
+    }
+    for(i = 0; i < TRACE_PENDING; i++){
+        if(trace_spans[i].state == SPAN_FREE){
+            trace_spans[i].state = SPAN_INGESTED;
+            trace_spans[i].cmd = data->cmd;
+            trace_spans[i].uid = data->uid;
+            trace_spans[i].ingest = trace_clock();
+            return trace_spans + i;
+        }
+    }
+    trace_dropped++;
+    return NULL;
+}
+
+void trace_applied(TraceSpan* span){
+    // Only the first stamp counts; a queued create isn't applied until it is admitted
+    if(span && span->state == SPAN_INGESTED){
+        span->applied = trace_clock();
+        span->state = SPAN_APPLIED;
+    }
+}
+
+void trace_dequeue(TraceSpan* span){
+    if(span && span->state == SPAN_QUEUED){
+        span->state = SPAN_INGESTED;
+    }
+}
+
+void trace_composed(){
+    uint32_t now;
+    uint8_t i;
+    if(!trace_clock){
+        return;
+    }
+    now = trace_clock();
+    for(i = 0; i < TRACE_PENDING; i++){
+        if(trace_spans[i].state == SPAN_APPLIED){
+            trace_spans[i].composed = now;
+            trace_spans[i].state = SPAN_COMPOSED;
+        }
+    }
+}
+
+void trace_count(uint8_t stage, uint32_t latency){
+    uint8_t b = 0;
+    while(b < TRACE_BUCKETS - 1 && ((uint32_t) 1 << b) <= latency){
+        b++;
+    }
+    trace_histogram[stage][b]++;
+}
+
+void trace_output(){
+    TraceSpan* span;
+    uint32_t now;
+    uint8_t i;
+    if(!trace_clock){
+        return;
+    }
+    now = trace_clock();
+    for(i = 0; i < TRACE_PENDING; i++){
+        span = trace_spans + i;
+        if(span->state != SPAN_COMPOSED){
+            continue;
+        }
+        span->output = now;
+        trace_count(TRACE_APPLY, span->applied - span->ingest);
+        trace_count(TRACE_COMPOSE, span->composed - span->applied);
+        trace_count(TRACE_OUTPUT, span->output - span->composed);
+        trace_count(TRACE_TOTAL, span->output - span->ingest);
+        if(trace_sink){
+            trace_sink(span);
+        }
+        span->state = SPAN_FREE;
+    }
+}
+#endif
+
+bool_t is_clock(canpacket_t* data){
+    return data->cmd == CMD_SYNC || data->cmd == CMD_TICK;
+}
+
+void message_batch(canpacket_t* data, uint16_t n){
+    // Every packet still moves the clock, runs automation & retries admission, in order. Only
+    // the effect ticks of a clock packet are left out, when the next one is another clock packet
+    // that isn't the last of the run: at a fractick other than 0 a tick only writes what the next
+    // one writes again, and _tick_subdecrement only keeps the spacing of the last two, which both
+    // run. Fractick 0 shifts pulse state, & a queued effect may be admitted as a timeout stops,
+    // so those always tick
+    for(; n; n--, data++){
+        if(!is_clock(data)){
+            message(data);
+            continue;
+        }
+        advance_clock(data->uid, data->cmd == CMD_TICK);
+        if(data->uid == 0 || admit_queued || n < 3 ||
+           !is_clock(data + 1) || data[1].uid == 0 || !is_clock(data + 2)){
+            tick_effects(data->uid);
+        }
+        tick_automation();
+        admit_retry();
+    }
+}
+
+/* Snapshots */
+
+uint16_t fletcher16(const uint8_t* buf, uint16_t len){
+    uint16_t a = 0;
+    uint16_t b = 0;
+    for(; len; len--, buf++){
+        a = (a + *buf) % 0xff;
+        b = (b + a) % 0xff;
+    }
+    return (b << 8) | a;
+}
+
+uint16_t snapshot_stack(Effect* eff, uint8_t* buf, uint16_t pos, uint16_t len){
+    // Append one stack; returns the new position, or 0 if it didn't fit
+    uint16_t count_pos = pos;
+    uint8_t count = 0;
+
+    if(pos >= len){
+        return 0;
+    }
+    pos++;
+    for(; eff; eff = eff->next, count++){
+        if(pos + 9 + eff->table->size > len){
+            return 0;
+        }
+        buf[pos++] = eff->table->eid;
+        buf[pos++] = eff->uid;
+        buf[pos++] = eff->blend;
+        buf[pos++] = eff->priority;
+        buf[pos++] = eff->z;
+        buf[pos++] = eff->start.tick & 0xff;
+        buf[pos++] = (eff->start.tick >> 8) & 0xff;
+        buf[pos++] = (eff->start.tick >> 16) & 0xff;
+        buf[pos++] = eff->start.frac;
+        memcpy(buf + pos, eff->data, eff->table->size);
+        pos += eff->table->size;
+    }
+    buf[count_pos] = count;
+    return pos;
+}
+
+uint16_t snapshot_track(AutomationTrack* track, uint8_t* buf, uint16_t pos){
+    uint8_t k;
+    buf[pos++] = track->kind;
+    buf[pos++] = track->group;
+    buf[pos++] = track->uid;
+    buf[pos++] = track->offset;
+    buf[pos++] = track->count;
+    buf[pos++] = track->start.tick & 0xff;
+    buf[pos++] = (track->start.tick >> 8) & 0xff;
+    buf[pos++] = (track->start.tick >> 16) & 0xff;
+    buf[pos++] = track->start.frac;
+    for(k = 0; k < AUTO_KEYS; k++){
+        buf[pos++] = track->keys[k].at & 0xff;
+        buf[pos++] = (track->keys[k].at >> 8) & 0xff;
+        buf[pos++] = (track->keys[k].at >> 16) & 0xff;
+        buf[pos++] = track->keys[k].at >> 24;
+        buf[pos++] = track->keys[k].value;
+        buf[pos++] = track->keys[k].curve;
+    }
+    return pos;
+}
+
+uint16_t snapshot_save(uint8_t* buf, uint16_t len){
+    uint16_t pos = 0;
+    uint16_t sum;
+    uint8_t g;
+    uint8_t s;
+    uint8_t t;
+
+    if(len < SNAPSHOT_HEADER){
+        return 0;
+    }
+    buf[pos++] = 'B';
+    buf[pos++] = 'S';
+    buf[pos++] = 'P';
+    buf[pos++] = 'K';
+    buf[pos++] = SNAPSHOT_VERSION;
+    buf[pos++] = STRIP_LENGTH;
+    buf[pos++] = clock.tick & 0xff;
+    buf[pos++] = (clock.tick >> 8) & 0xff;
+    buf[pos++] = (clock.tick >> 16) & 0xff;
+    buf[pos++] = clock.frac;
+    memcpy(buf + pos, parameters, PARAM_LEN);
+    pos += PARAM_LEN;
+    buf[pos++] = layout;
+    buf[pos++] = layout_param;
+    buf[pos++] = 0xff;
+    for(g = 0; g < NUM_GROUPS; g++){
+        if(editing == &groups[g].effects){
+            buf[pos - 1] = g;
+        }
+    }
+    memcpy(buf + pos, palette, 4 * PALETTE_SIZE);
+    pos += 4 * PALETTE_SIZE;
+    for(t = 0; t < NUM_TRACKS; t++){
+        pos = snapshot_track(tracks + t, buf, pos);
+    }
+
+    pos = snapshot_stack(effects.head, buf, pos, len);
+    for(g = 0; g < NUM_GROUPS && pos; g++){
+        pos = snapshot_stack(groups[g].effects.head, buf, pos, len);
+    }
+    for(s = 1; s < NUM_SOURCES && pos; s++){
+        pos = snapshot_stack(source_stack(s)->head, buf, pos, len);
+    }
+    if(pos == 0 || pos + 2 > len){
+        return 0;
+    }
+    sum = fletcher16(buf, pos);
+    buf[pos++] = sum & 0xff;
+    buf[pos++] = sum >> 8;
+    return pos;
+}
+
+uint16_t restore_stack(EffectStack* stack, const uint8_t* buf, uint16_t pos, uint16_t len, bool_t apply, uint8_t* count_all){
+    // Check (and if `apply`, rebuild) one stack; returns the new position, or 0 if it is invalid
+    // `count_all` counts effects across every stack, so the check pass can refuse too many
+    const EffectTable* table;
+    Effect* eff;
+    uint8_t count;
+    uint8_t seen[256 / 8]; // uids already in this stack
+
+    if(pos >= len){
+        return 0;
+    }
+    memset(seen, 0, sizeof(seen));
+    for(count = buf[pos++]; count; count--){
+        if(pos + 9 > len || (table = find_effect_table(buf[pos])) == NULL){
+            return 0;
+        }
+        if(seen[buf[pos + 1] >> 3] & (1 << (buf[pos + 1] & 0x7))){
+            // find_effect would only ever reach the first
+            return 0;
+        }
+        seen[buf[pos + 1] >> 3] |= 1 << (buf[pos + 1] & 0x7);
+        if(pos + 9 + table->size > len || buf[pos + 2] >= NUM_BLEND_MODES){
+            return 0;
+        }
+        if(buf[pos + 2] != BLEND_OVER && stack_id(stack) < NUM_GROUPS){
+            // Group members only blend with alpha over (see CMD_BLEND)
+            return 0;
+        }
+        if(apply){
+            eff = alloc_effect();
+            eff->table = (EffectTable*) table;
+            eff->uid = buf[pos + 1];
+            eff->blend = buf[pos + 2];
+            eff->priority = buf[pos + 3];
+            eff->z = buf[pos + 4];
+            eff->start.tick = buf[pos + 5] | (buf[pos + 6] << 8) | ((uint32_t) buf[pos + 7] << 16);
+            eff->start.frac = buf[pos + 8];
+            memset(eff->data, 0x00, sizeof(eff->data));
+            memcpy(eff->data, buf + pos + 9, table->size);
+            // Saved bottom first, so each one goes on top
+            link_effect(stack, eff);
+        }else if(*count_all >= EFFECTS_HEAP_SIZE){
+            // More effects than we can hold
+            return 0;
+        }
+        (*count_all)++;
+        pos += 9 + table->size;
+    }
+    return pos;
+}
+
+bool_t restore_track(AutomationTrack* track, const uint8_t* buf, bool_t apply){
+    // Check (and if `apply`, load) one track; returns false if it is invalid
+    const uint8_t* key;
+    uint8_t k;
+
+    if(buf[0] > AUTO_PARAM || buf[1] >= NUM_STACKS || buf[4] > AUTO_KEYS){
+        return 0;
+    }
+    for(k = 0, key = buf + 9; k < AUTO_KEYS; k++, key += 6){
+        if(key[5] >= NUM_CURVES){
+            return 0;
+        }
+    }
+    if(apply){
+        track->kind = buf[0];
+        track->group = buf[1];
+        track->uid = buf[2];
+        track->offset = buf[3];
+        track->count = buf[4];
+        track->start.tick = buf[5] | (buf[6] << 8) | ((uint32_t) buf[7] << 16);
+        track->start.frac = buf[8];
+        for(k = 0, key = buf + 9; k < AUTO_KEYS; k++, key += 6){
+            track->keys[k].at = key[0] | (key[1] << 8) | ((uint32_t) key[2] << 16) | ((uint32_t) key[3] << 24);
+            track->keys[k].value = key[4];
+            track->keys[k].curve = key[5];
+        }
+    }
+    return 1;
+}
+
+uint8_t snapshot_restore(const uint8_t* buf, uint16_t len){
+    uint16_t pos;
+    uint8_t pass;
+    uint8_t g;
+    uint8_t t;
+    uint8_t edit;
+    uint8_t count;
+
+    if(len < SNAPSHOT_HEADER + 2 || memcmp(buf, "BSPK", 4) != 0){
+        return SNAPSHOT_INVALID;
+    }
+    if(buf[4] != SNAPSHOT_VERSION || buf[5] != STRIP_LENGTH || buf[10 + PARAM_LEN] >= NUM_LAYOUTS){
+        return SNAPSHOT_INVALID;
+    }
+    len -= 2;
+    if(fletcher16(buf, len) != (buf[len] | (buf[len + 1] << 8))){
+        return SNAPSHOT_INVALID;
+    }
+
+    // Pass 0 checks every stack, pass 1 rebuilds them
+    for(pass = 0; pass < 2; pass++){
+        if(pass){
+            // The fragment slots are only known while the heap is the old one
+            for(g = 0; g < NUM_SOURCES; g++){
+                frag_abort(g);
+            }
+            for(g = 0; g < NUM_STACKS; g++){
+                clear_stack(stack_by_id(g));
+            }
+            for(g = 0; g < NUM_GROUPS; g++){
+                groups[g].valid = 0;
             }
+            init_effects_heap();
         }
+        for(t = 0; t < NUM_TRACKS; t++){
+            pos = 13 + PARAM_LEN + 4 * PALETTE_SIZE + t * SNAPSHOT_TRACK;
+            if(!restore_track(tracks + t, buf + pos, pass)){
+                return SNAPSHOT_INVALID;
+            }
+        }
+        count = 0;
+        pos = SNAPSHOT_HEADER;
+        pos = restore_stack(&effects, buf, pos, len, pass, &count);
+        for(g = 0; g < NUM_GROUPS && pos; g++){
+            pos = restore_stack(&groups[g].effects, buf, pos, len, pass, &count);
+        }
+        for(g = 1; g < NUM_SOURCES && pos; g++){
+            pos = restore_stack(source_stack(g), buf, pos, len, pass, &count);
+        }
+        if(pos != len){
+            return SNAPSHOT_INVALID;
+        }
+    }
+    effects_running = count;
+    // Nothing half-done before the restore applies to the restored effects
+    admit_clear();
+    memset(pending_z_set, 0, sizeof(pending_z_set));
+    memset(recording, 0, sizeof(recording));
+
+    clock.tick = buf[6] | (buf[7] << 8) | ((uint32_t) buf[8] << 16);
+    clock.frac = buf[9];
+    memcpy(parameters, buf + 10, PARAM_LEN);
+    set_layout(buf[10 + PARAM_LEN], buf[11 + PARAM_LEN]);
+    edit = buf[12 + PARAM_LEN];
+    for(g = 0; g < NUM_SOURCES; g++){
+        source_editing[g] = source_stack(g);
     }
+    editing = (edit < NUM_GROUPS) ? &groups[edit].effects : &effects;
+    memcpy(palette, buf + 13 + PARAM_LEN, 4 * PALETTE_SIZE);
+    palette_generation++;
+    return SNAPSHOT_OK;
 }
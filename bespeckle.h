@@ -9,6 +9,19 @@
 
 #endif
 
+#ifndef STRIP_LENGTH
+// Length of LED strip
+// sizeof(position_t) > STRIP_LENGTH
+#define STRIP_LENGTH 50
+#endif
+
+#ifndef PHYSICAL_LENGTH
+// Number of LEDs actually driven. Effects render STRIP_LENGTH logical pixels, which
+// pixel_map spreads over the physical strip; mirrored or tiled installs need fewer logical pixels
+// sizeof(position_t) > PHYSICAL_LENGTH
+#define PHYSICAL_LENGTH STRIP_LENGTH
+#endif
+
 #define RGBA_R_SHIFT 5
 #define RGBA_R_MASK  (0x1f << RGBA_R_SHIFT) // 5 bits
 #define RGBA_G_SHIFT 0
@@ -51,6 +64,19 @@
 #define CMD_RESET    0x83
 #define CMD_REBOOT   0x84 // TODO
 #define CMD_PARAM    0x85
+#define CMD_BLEND    0x86
+#define CMD_GROUP    0x87 // uid is the group; data[0] is one of GROUP_*
+#define CMD_LAYOUT   0x89 // uid is one of LAYOUT_*; data[0] is its parameter
+#define CMD_BUDGET   0x8A // uid is one of BUDGET_*; data[0:1] is the frame budget, 0 for none
+#define CMD_PRIORITY 0x8B // data[0] is the priority of effect `uid`
+#define CMD_REPORT   0x8C // Sent by the node: admission of effect `uid` (see `report`)
+#define CMD_ZORDER   0x8D // data[0] is the z-index of effect `uid`, or of the next one created with it
+#define CMD_PALETTE  0x8E // data[0:3] is the RGBA color of palette entry `uid` & the next data[4] - 1
+#define CMD_FRAG     0x90 // | seq: data[0:5] are bytes 6 * seq onwards of the data for effect `uid`
+#define CMD_FRAG_COMMIT 0x98 // data[0] is the eid & data[1] one of FRAG_*; see fragmented transfers
+#define CMD_AUTO     0x99 // data[0] is one of AUTO_* for automation track `uid`; see automation
+#define CMD_SCENE    0x9A // data[0] is one of SCENE_* for scene `uid`; see scenes
+#define CMD_POWER    0x9B // data[0:1] is the power budget, 0 for none; data[2] the release rate
 
 #define CMD_TICK     0x88
 
@@ -99,9 +125,23 @@ typedef struct {
 	*/
 } hsva_t;
 
+// Effects stack storage
+#ifndef EFFECTS_HEAP_SIZE
+#define EFFECTS_HEAP_SIZE 50
+#endif
+#if EFFECTS_HEAP_SIZE > 255
+#error "EffectStack.by_uid holds heap slots in a byte"
+#endif
+
 void init_effects_heap(void);
 uint8_t effects_running;
 
+// Colors that palette effects (0x60-0x63) draw by index, written with CMD_PALETTE
+// Survives CMD_RESET. `palette_generation` counts writes, so cached renders notice a recolor
+#define PALETTE_SIZE 256
+extern rgba_t palette[PALETTE_SIZE];
+extern uint32_t palette_generation;
+
 // Convert between different color formats
 rgb_t pack_rgba(rgba_t);
 rgba_t unpack_rgb(rgb_t);
@@ -112,6 +152,21 @@ rgba_t mix_rgba(rgba_t, rgba_t);
 rgb_t mix_rgb(rgba_t, rgb_t);
 rgb_t filter_rgb(rgb_t, uint8_t, uint8_t, uint8_t, uint8_t);
 
+// Blend modes, set per effect with CMD_BLEND. Every mode is weighted by the top alpha,
+// so a clear pixel never changes what is below it. Members of a layer group are always
+// stacked with alpha over, so CMD_BLEND is ignored inside a group; blend the 0x50 layer instead
+#define BLEND_OVER      0 // Alpha over (mix_rgb)
+#define BLEND_ADD       1 // Add, saturating
+#define BLEND_MULTIPLY  2
+#define BLEND_SCREEN    3
+#define BLEND_MAX       4 // Lighten; per channel maximum
+#define BLEND_MASK      5 // Erase what is below, by alpha; the layer's color is ignored
+#define NUM_BLEND_MODES 6
+
+// Blend a layer of `n` pixels onto packed pixels, strip-wide
+typedef void (* blend_kernel_t)(rgb_t*, const rgba_t*, position_t);
+extern blend_kernel_t const blend_kernels[NUM_BLEND_MODES];
+
 
 // Structure of incomming CAN packets
 // sizeof(canpacket_t) == 8
@@ -124,18 +179,45 @@ typedef struct {
 
 void message(canpacket_t*);
 
+// Apply `n` packets in order, leaving exactly what passing each to message() would, but in a
+// run of CMD_SYNC / CMD_TICK packets only tick the effects for those at fractick 0 and the last
+// two. Catching up after a stall costs O(effects) per beat instead of per sync
+void message_batch(canpacket_t*, uint16_t);
+
 // Base struct for an Effect
 // All effects MUST start with these pointers
-// `next` is used as a pointer to the next Effect in the linked list
+// `next` is used as a pointer to the next Effect in the linked list, `prev` to the one below it
 // `tick` is a function called multiple times per beat to update the effect
 // `pixel` is a function called to get the color value of a single pixel
 
 struct EffectTable;
 
+typedef struct tick_t {
+    uint32_t tick:24;
+    fractick_t frac:8;
+} tick_t;
+
+extern tick_t clock;
+
+// Most pixel intervals an Effect can draw in during one frame
+#define MAX_EXTENTS 2
+
+// `start` is the clock when the Effect was created; stateless effects derive
+// everything they draw from (now - start) in `prepare`
+// `extents` are the [lo, hi) pixel intervals this frame may draw in; every other pixel is clear.
+// They cover the whole strip unless `prepare` narrows them
+// `z` orders the stack: higher z is drawn on top; equal z in creation order
 typedef struct Effect {
 	struct Effect * next;
+	struct Effect * prev;
 	struct EffectTable* table;
 	uint8_t uid;
+	uint8_t blend;
+	uint8_t priority;
+	uint8_t z;
+	uint8_t num_extents;
+	position_t extents[MAX_EXTENTS][2];
+	tick_t start;
 	uint8_t data[32] __attribute__ ((aligned(4))); // I'm a bad person XXX
 } Effect;
 
@@ -143,40 +225,470 @@ typedef struct EffectTable {
 	uint8_t eid;
 	uint8_t size;
 	void (* setup)(struct Effect *, canpacket_t*);
+	void (* derive)(struct Effect *);
 	bool_t (* tick)(struct Effect *, fractick_t);
 	rgba_t (* pixel)(struct Effect *, position_t);
 	bool_t (* msg)(struct Effect *, canpacket_t*);
+	void (* prepare)(struct Effect *, tick_t);
+	uint8_t cost; // Declared render cost per pixel, relative to a solid color
 } EffectTable;
 
-typedef struct tick_t {
-    uint32_t tick:24;
-    fractick_t frac:8;
-} tick_t;
+// A render loop specialized for one stack of `pixel` functions, bottom first
+// `compose` writes the mixed (unfiltered) pixels for a stack that matches exactly
+#define FUSED_MAX_LAYERS 3
+typedef struct FusedKernel {
+	uint8_t layers;
+	rgba_t (* pixels[FUSED_MAX_LAYERS])(struct Effect *, position_t);
+	void (* compose)(struct Effect *, rgb_t*);
+} FusedKernel;
+
+// A stack of effects, bottom first, kept sorted by z
+// `tail` holds the heap slot of the topmost effect of each distinct z in use, so finding where
+// an effect goes is a binary search over `z` and inserting or moving it is a splice
+// A stack can't hold more effects than the heap, so there is always a level for a new z
+#define Z_LEVELS     EFFECTS_HEAP_SIZE
+#define Z_DEFAULT    0x80
+
+// `by_uid` indexes the stack by uid: the heap slot + 1 of the effect with each uid, 0 for none
+typedef struct EffectStack {
+	Effect* head;
+	uint8_t levels;
+	uint8_t z[Z_LEVELS];
+	uint8_t tail[Z_LEVELS];
+	uint8_t by_uid[256];
+} EffectStack;
+
+extern EffectStack effects;
+
+/* Sources
+ * Every controller driving the node gets a namespace of its own: a stack with its own 256
+ * uids, so two controllers using the same uid don't replace each other's layers.
+ * Drivers pass packets from controller `s` to message_from(s, ...); message() is source 0,
+ * whose stack is `effects`. populate_strip composites the stacks in source order, source 0
+ * at the bottom. Each source has its own GROUP_SELECT state, pending CMD_ZORDER, fragmented
+ * transfer & scene recording; the layer groups, the clock, parameters, palette, scenes &
+ * CMD_RESET are shared.
+ */
+#ifndef NUM_SOURCES
+#define NUM_SOURCES  4
+#endif
 
-extern tick_t clock;
+// Every stack by id: each group, then each source (NUM_GROUPS is `effects`)
+#define NUM_STACKS   (NUM_GROUPS + NUM_SOURCES)
+
+void message_from(uint8_t, canpacket_t*);
+EffectStack* source_stack(uint8_t);
+EffectStack* stack_by_id(uint8_t);
+uint8_t stack_id(EffectStack*);
+
+// Insert an effect above every effect with the same or lower z
+void link_effect(EffectStack*, Effect*);
+
+// Take an effect out of a stack without freeing it
+void unlink_effect(EffectStack*, Effect*);
+
+// Move an effect to z-index `z`
+void set_z(EffectStack*, Effect*, uint8_t);
+
+// Put an unlinked effect in the place of `old` (same stack position, uid, blend, ...) & free `old`
+void replace_effect(EffectStack*, Effect*, Effect*);
 
 void time_add(tick_t*, uint32_t, uint8_t);
 int32_t time_sub(tick_t, tick_t);
 
+// Division by a reciprocal computed once, for parts without a hardware divider
+// recip(d) is floor(2^RECIP_SHIFT / d). div_recip(n, d, recip(d)) is exactly n / d
+// whenever n < 2^RECIP_SHIFT and n / d < 256: one multiply, one shift, and one correction step
+#define RECIP_SHIFT  24
+uint32_t recip(uint32_t);
+uint32_t div_recip(uint32_t, uint32_t, uint32_t);
+
 // Calls `tick` on every Effect in the linked list;
 // Removes Effects from the list that have nonzero return values when fractick == 0
 // Always calls tick with fractick = 0 for every beat
-Effect* tick_all(Effect*, fractick_t, uint8_t);
+void tick_all(EffectStack*, fractick_t, uint8_t);
+
+// Moves the clock to fractick `ft` of this beat, or to the next beat
+void advance_clock(fractick_t, uint8_t);
+
+// Layer groups: a sub-stack of effects rendered into its own buffer, then drawn as one
+// layer by effect 0x50. The buffer is only re-rendered when the members' state changes
+#ifndef NUM_GROUPS
+#define NUM_GROUPS   4
+#endif
+
+// CMD_GROUP operations
+#define GROUP_END    0 // Following packets go to the main stack again
+#define GROUP_SELECT 1 // Following create/stop/msg packets go to group `uid`
+#define GROUP_CLEAR  2 // Remove every effect in group `uid`
+
+typedef struct LayerGroup {
+    EffectStack effects;
+    uint32_t hash;     // Hash of the members' state when `buffer` was rendered
+    uint32_t frame;    // Last frame the members were prepared for
+    bool_t valid;
+    bool_t rendering;
+    rgba_t buffer[STRIP_LENGTH];
+} LayerGroup;
+
+extern LayerGroup groups[NUM_GROUPS];
+
+// Brings the buffer of a group up to date for time `now`
+void render_group(uint8_t, tick_t);
+
+// Ticks every Effect in a stack without touching the clock
+void tick_list(EffectStack*, fractick_t);
+
+// Ticks every source's stack & every group, without touching the clock
+void tick_effects(fractick_t);
+
+// Advances the clock, ticks every effect, then runs automation & retries queued effects
+void tick_engine(fractick_t, uint8_t);
+
+/* Per-type ticking
+ * With TICK_BY_TYPE defined, tick_engine ticks by effect type instead of walking every stack.
+ * `ticking` is an index of pointers: each live effect, grouped by table and in heap order within
+ * a group. effect_tick_types (effects.c, generated from the catalogue) runs one loop per type
+ * that calls its tick function directly, so it inlines; for the stateless types (_tick_nothing,
+ * most of them) the loop is empty. The data itself stays in the effect's heap slot; instances of
+ * a type are visited in address order, but aren't contiguous. The index is rebuilt on the
+ * first tick after an effect is linked or freed. Stopped effects are removed at the same tick
+ * as before, by one walk over the stacks once every tick is done.
+ */
+#ifdef TICK_BY_TYPE
+void tick_types(fractick_t);
+#endif
+
+// Replace / add to the pixel intervals an Effect draws in this frame; clipped to the strip
+void set_extent(Effect*, int16_t, int16_t);
+void add_extent(Effect*, int16_t, int16_t);
+
+// Calls `prepare` on every Effect in the linked list with the time being rendered
+void prepare_all(Effect*, tick_t);
+
+/* Admission control
+ * Every layer costs its table `cost` (+1 if it isn't BLEND_OVER) per pixel per frame.
+ * With a frame budget set, an effect that would push the total over it is rejected, queued
+ * until enough effects stop, or admitted by evicting the lowest priority layers, per the policy.
+ * When a budget is set, every decision is sent to `report` as a CMD_REPORT packet:
+ *  uid: the effect; data[0]: ADMIT_*; data[1]: evicted uid; data[2:3]: total cost; data[4:5]: budget
+ */
+#define BUDGET_REJECT    0
+#define BUDGET_QUEUE     1
+#define BUDGET_EVICT     2
+
+#define ADMIT_ACCEPTED   0
+#define ADMIT_REJECTED   1
+#define ADMIT_QUEUED     2
+#define ADMIT_EVICTED    3
+
+// Effects with a priority above the default are never evicted by new effects
+#define PRIORITY_DEFAULT 0x80
+#define ADMIT_QUEUE_LEN  4
+
+extern uint16_t frame_budget;
+extern uint8_t budget_policy;
+
+// Called with outgoing packets; the driver should send them on the bus
+extern void (* report)(canpacket_t*);
+
+// Estimated cost of a layer / of everything the engine renders each frame
+uint16_t effect_cost(Effect*);
+uint16_t engine_cost(void);
+
+// Create an effect on a stack from a creation packet, subject to the frame budget
+// `slot` is an unlinked effect whose data is already written (see fragmented transfers), or NULL
+void create_effect(EffectStack*, const EffectTable*, canpacket_t*, Effect*);
+
+/* Fragmented transfers
+ * A packet carries CAN_DATA_SIZE bytes but effect data is up to 32. CMD_FRAG | seq packets write
+ * straight into a heap slot that is in no stack, so nothing can render it half written.
+ * CMD_FRAG_COMMIT for the same uid then checks every fragment the effect's size needs arrived, and:
+ *  FRAG_CREATE: creates effect `uid` in that slot, as if the first CAN_DATA_SIZE bytes were its
+ *               creation packet; `setup` runs, except _setup_copy leaves the data as written
+ *  FRAG_UPDATE: swaps the slot in for the existing effect `uid` of the same eid, keeping its place,
+ *               start, blend & priority; `setup` then runs as for FRAG_CREATE, so end times,
+ *               reciprocals & starting values are derived from the new data
+ * One transfer at a time per source: a fragment for another uid starts over, and a failed commit
+ * drops it. Each source has its own transfer, like its own uids
+ */
+#define FRAG_SEQ_MASK 0x07
+#define FRAG_CREATE   0
+#define FRAG_UPDATE   1
+
+// Handle CMD_FRAG | seq & CMD_FRAG_COMMIT packets
+void frag_write(canpacket_t*);
+void frag_commit(canpacket_t*);
+
+// Drop source s's transfer in progress
+void frag_abort(uint8_t);
+
+// Whether an unlinked slot is being written by a transfer
+bool_t is_frag_slot(Effect*);
+
+/* Automation
+ * A track moves one byte of effect data, or one global parameter, through up to AUTO_KEYS
+ * keyframes on its own, evaluated against `clock` on every tick. Keyframe times count from
+ * when the track was bound; each key's curve shapes the way to the next one. Past the last
+ * key the value holds and the track ends; it also ends if its effect stops. After each write the
+ * effect's `derive` runs, so reciprocals & end times follow the byte. Bytes that `prepare` rewrites
+ * every frame are overwritten; for effects that start from xs[4:7], move those instead.
+ *  AUTO_BIND: data[1] is AUTO_EFFECT or AUTO_PARAM, data[2] the effect uid (on the editing stack)
+ *             or parameter index, data[3] the byte of effect data. Starts the track with no keys
+ *  AUTO_KEY:  data[1:2] beats & data[3] fracticks after the bind, data[4] the value, data[5] the
+ *             curve. Keys must be sent in time order
+ *  AUTO_STOP: ends the track, leaving the value where it is
+ */
+#ifndef NUM_TRACKS
+#define NUM_TRACKS   8
+#endif
+#define AUTO_KEYS    4
+
+#define AUTO_BIND    0
+#define AUTO_KEY     1
+#define AUTO_STOP    2
+
+#define AUTO_OFF     0
+#define AUTO_EFFECT  1
+#define AUTO_PARAM   2
+
+#define CURVE_STEP   0 // Jump to the next value when its key is reached
+#define CURVE_LINEAR 1
+#define CURVE_EASE   2 // Smoothstep: slow at both ends
+#define NUM_CURVES   3
+
+typedef struct Keyframe {
+    uint32_t at; // Fracticks after the track was bound
+    uint8_t value;
+    uint8_t curve;
+} Keyframe;
+
+typedef struct AutomationTrack {
+    uint8_t kind;
+    uint8_t group;  // Stack of the effect, by stack_by_id
+    uint8_t uid;    // Effect uid, or parameter index
+    uint8_t offset; // Byte of effect data
+    uint8_t count;
+    tick_t start;
+    Keyframe keys[AUTO_KEYS];
+} AutomationTrack;
+
+extern AutomationTrack tracks[NUM_TRACKS];
+
+// Handle a CMD_AUTO packet
+void auto_message(canpacket_t*);
+
+// Write the current value of every track; called by tick_engine
+void tick_automation(void);
+
+/* Scenes
+ * A scene is a list of up to SCENE_PACKETS packets (creates, blends, groups, parameters, ...)
+ * kept on the device, so a whole look starts from one packet, between two frames.
+ *  SCENE_RECORD: store the packets that follow from the same source in scene `uid` instead of
+ *                applying them, until that source's SCENE_END. Syncs, ticks & scene packets still
+ *                apply, as do other sources' packets; packets past the end are lost
+ *  SCENE_END:    stop recording, and hand the scene to `scene_store` to keep (flash, a file, ...)
+ *  SCENE_PLAY:   apply every packet of scene `uid` in one message_batch. With SCENE_REPLACE in
+ *                data[1], every stack is cleared first
+ *  SCENE_ERASE:  empty scene `uid`
+ * Scenes survive CMD_RESET and are not in snapshots; the driver loads stored ones into `scenes`
+ */
+#ifndef NUM_SCENES
+#define NUM_SCENES    4
+#endif
+#ifndef SCENE_PACKETS
+#define SCENE_PACKETS 16
+#endif
+
+#define SCENE_RECORD  0
+#define SCENE_END     1
+#define SCENE_PLAY    2
+#define SCENE_ERASE   3
+
+#define SCENE_REPLACE 0x1
+
+typedef struct Scene {
+    uint8_t count;
+    canpacket_t packets[SCENE_PACKETS];
+} Scene;
+
+extern Scene scenes[NUM_SCENES];
+
+// Called with each newly recorded scene & its number; NULL to keep scenes in RAM only
+extern void (* scene_store)(uint8_t, const Scene*);
+
+// Handle a CMD_SCENE packet
+void scene_message(canpacket_t*);
+
+// Finds the fused kernel for a list of effects, or NULL if there is none
+// Only lists whose every layer covers the whole strip (see extents) use one; call after prepare_all
+const FusedKernel* find_fused_kernel(Effect*);
+
+// Physical layouts; each maps the whole logical strip onto every segment it makes
+#define LAYOUT_LINEAR     0 // Stretched over the strip
+#define LAYOUT_REVERSE    1 // Stretched, last logical pixel first
+#define LAYOUT_MIRROR     2 // Out and back; the second half mirrors the first
+#define LAYOUT_REPEAT     3 // Tiled `param` times
+#define LAYOUT_SERPENTINE 4 // Rows of `param` pixels, every other row wired backwards
+#define NUM_LAYOUTS       5
+
+// Logical pixel shown by each physical pixel
+extern position_t pixel_map[PHYSICAL_LENGTH];
+extern uint8_t layout;
+extern uint8_t layout_param;
+
+// Rebuild pixel_map for a layout
+void set_layout(uint8_t, uint8_t);
+
+/* Power limiting
+ * Current follows brightness, and a full white strip browns out most supplies. As it scatters
+ * each frame, the compositor adds up the 5 bit channels of every physical pixel (93 for white).
+ * When the total is over `power_budget`, that same frame is scaled down to fit before it goes
+ * out, so a sudden jump never gets a frame over budget. Once it fits again the scale climbs back
+ * by `power_release` per frame, so busy looks don't pump. A frame's scale therefore depends on
+ * at most the POWER_FULL / power_release frames before it (render -j composes those first).
+ */
+#define POWER_FULL    0xff
+#define POWER_RELEASE 4
+
+extern uint16_t power_budget;
+extern uint8_t power_release;
+extern uint8_t power_scale; // The scale of the last frame; POWER_FULL while under budget
+
+// Scale a composed strip to the budget, given its channel total & the scale of the frame before
+void power_limit(rgb_t*, uint32_t);
 
 // Composites a list of effects into a single set of packed pixels
+// `strip` holds PHYSICAL_LENGTH pixels
+// compose_at renders the list as it appears at an arbitrary time; compose_all uses `clock`
+// compose_lists draws several lists, each on top of the ones before; populate_strip every source's
+void compose_lists(Effect**, uint8_t, rgb_t*, tick_t);
+void compose_at(Effect*, rgb_t*, tick_t);
 void compose_all(Effect*, rgb_t*);
 void populate_strip(rgb_t*);
 
+/* Output stage
+ * Diffs each composed strip against the last one sent, so outputs only send what changed.
+ * output_frame calls `sink` once per span of changed physical pixels (start, length, pixels),
+ * bottom first, and returns how many pixels changed; 0 means the frame can be skipped entirely.
+ * Spans closer than SPAN_MERGE_GAP unchanged pixels are sent as one, since every span costs a
+ * header on the wire. `sink` may be NULL for drivers that only need the count.
+ * The whole strip is one span for the first frame, and after output_invalidate
+ */
+#ifndef SPAN_MERGE_GAP
+#define SPAN_MERGE_GAP 4
+#endif
+
+typedef void (* span_sink_t)(uint16_t, uint16_t, const rgb_t*);
+
+uint16_t output_frame(const rgb_t*, span_sink_t);
+
+// Forget what was sent, e.g. when a receiver reconnects
+void output_invalidate(void);
+
+/* Tracing
+ * With TRACE defined, each packet is followed from message() to the output: when it arrived,
+ * when it was applied (a sync or tick once the effects ticked, a create once the effect is on
+ * its stack, which for a queued one is when it is admitted), when the next compose finished
+ * (the first frame it can show in), and when the driver handed that frame to the strip, calling
+ * trace_output. `trace_clock` must return microseconds; nothing is traced while it is NULL.
+ * Stamps wrap after about 71 minutes; latencies are taken modulo 2^32, so they stay right.
+ * Finished spans go to `trace_sink`, and into trace_histogram by stage, in log2 buckets:
+ * bucket b counts latencies under 2^b us, and the last one everything longer.
+ * At most TRACE_PENDING packets are followed at once; the rest are counted in trace_dropped.
+ */
+#ifdef TRACE
+#define TRACE_PENDING  16
+#define TRACE_BUCKETS  16
+
+// Stages, for trace_histogram
+#define TRACE_APPLY    0 // Arrival to applied
+#define TRACE_COMPOSE  1 // Applied to composed
+#define TRACE_OUTPUT   2 // Composed to handed off
+#define TRACE_TOTAL    3 // Arrival to handed off
+#define TRACE_STAGES   4
+
+// TraceSpan states
+#define SPAN_FREE      0
+#define SPAN_INGESTED  1
+#define SPAN_APPLIED   2
+#define SPAN_COMPOSED  3
+#define SPAN_QUEUED    4 // A create waiting for admission
+
+typedef struct TraceSpan {
+    uint8_t state;
+    uint8_t cmd;
+    uint8_t uid;
+    uint32_t ingest;
+    uint32_t applied;
+    uint32_t composed;
+    uint32_t output;
+} TraceSpan;
+
+extern uint32_t (* trace_clock)(void);
+extern void (* trace_sink)(const TraceSpan*);
+extern uint32_t trace_histogram[TRACE_STAGES][TRACE_BUCKETS];
+extern uint32_t trace_dropped;
+
+// Called by message() & wherever it applies a packet, and by compose_at
+TraceSpan* trace_ingest(canpacket_t*);
+void trace_applied(TraceSpan*);
+void trace_dequeue(TraceSpan*);
+void trace_composed(void);
+// Called by the driver once the last composed frame is on its way to the strip
+void trace_output(void);
+#endif
+
 // Sends (continuation) message to the correct Effect
-Effect* msg_all(Effect*, canpacket_t*);
+void msg_all(EffectStack*, canpacket_t*);
+
+// Find an Effect in a stack via uid, in O(1) with its index; NULL if there is none
+Effect* find_effect(EffectStack*, uint8_t);
 
 // Remove an Effect from the Effect stack via uid
-void pop_effect(Effect**, uint8_t);
+void pop_effect(EffectStack*, uint8_t);
 
-// Add Effect ot the top of an Effect stack
-void push_effect(Effect**, Effect*);
+// Add Effect to the top of its z level in an Effect stack, replacing any with the same uid
+void push_effect(EffectStack*, Effect*);
 
 // Free effect memory. Malloc is part of creating an effect from a CAN msg
 void free_effect(Effect*);
 
+// Find an unused slot in the effects heap; NULL if it is full
+Effect* alloc_effect(void);
+
+// Find the table entry for an effect id; NULL if this device doesn't implement it
+const EffectTable* find_effect_table(uint8_t);
+
+// Remove every Effect from a stack
+void clear_stack(EffectStack*);
+
+/* Snapshots
+ * A compact, versioned copy of the whole engine state: clock, parameters, layout, palette, and
+ * every stack in order. Effects are stored by eid, so a snapshot survives a rebuild of the firmware.
+ * Save one every few seconds to flash (or a file on the host); restoring it brings a restarted
+ * node back to the exact scene before the next frame.
+ *
+ *  "BSPK" version strip_length clock[4] parameters[PARAM_LEN] layout layout_param editing
+ *  palette[PALETTE_SIZE][4]
+ *  per automation track: kind group uid offset count start[4], then per key: at[4] value curve
+ *  for the main stack, each group, then each other source: count, then per effect:
+ *    eid uid blend priority z start[4] data[size]
+ *  checksum[2] (Fletcher-16 of everything before it)
+ */
+#define SNAPSHOT_VERSION  8
+#define SNAPSHOT_OK       0
+#define SNAPSHOT_INVALID  1
+
+#define SNAPSHOT_TRACK    (9 + 6 * AUTO_KEYS)
+#define SNAPSHOT_HEADER   (13 + PARAM_LEN + 4 * PALETTE_SIZE + NUM_TRACKS * SNAPSHOT_TRACK)
+#define SNAPSHOT_MAX_SIZE (SNAPSHOT_HEADER + NUM_STACKS + EFFECTS_HEAP_SIZE * (9 + 32) + 2)
+
+// Write a snapshot into a buffer; returns its length, or 0 if it didn't fit
+uint16_t snapshot_save(uint8_t*, uint16_t);
+
+// Replace the engine state with a snapshot. Nothing changes unless it returns SNAPSHOT_OK; a bad
+// checksum, an unknown effect or layout, or two effects with one uid in a stack are SNAPSHOT_INVALID
+uint8_t snapshot_restore(const uint8_t*, uint16_t);
+
 #endif
@@ -18,16 +18,42 @@ typedef struct edata_char4 {
     uint8_t xs[4];
 } edata_char4;
 
+typedef struct edata_char4_int1 {
+    uint8_t xs[4];
+    uint32_t ys[1];
+} edata_char4_int1;
+
 typedef struct edata_rgba1_char4 {
     rgba_t cs[1];
     uint8_t xs[4];
 } edata_rgba1_char4;
 
-typedef struct edata_rgba1_char4_int4 {
+// xs[0:3] are the live values read by `pixel`; xs[4:7] keep the values the effect started from
+typedef struct edata_rgba1_char8 {
+    rgba_t cs[1];
+    uint8_t xs[8];
+} edata_rgba1_char8;
+
+typedef struct edata_rgba2 {
+    rgba_t cs[2];
+} edata_rgba2;
+
+typedef struct edata_rgba2_char4 {
+    rgba_t cs[2];
+    uint8_t xs[4];
+} edata_rgba2_char4;
+
+typedef struct edata_rgba1_char8_char4 {
+    rgba_t cs[1];
+    uint8_t xs[8];
+    uint8_t ps[4];
+} edata_rgba1_char8_char4;
+
+typedef struct edata_rgba1_char4_int6 {
     rgba_t cs[1];
     uint8_t xs[4];
-    uint32_t ys[4];
-} edata_rgba1_char4_int4;
+    uint32_t ys[6];
+} edata_rgba1_char4_int6;
 
 typedef struct edata_rgba1_char4_time1 {
     rgba_t cs[1];
@@ -35,12 +61,33 @@ typedef struct edata_rgba1_char4_time1 {
     tick_t ts[1];
 } edata_rgba1_char4_time1;
 
+typedef struct edata_rgba1_char4_time1_int2 {
+    rgba_t cs[1];
+    uint8_t xs[4];
+    tick_t ts[1];
+    uint32_t ys[2];
+} edata_rgba1_char4_time1_int2;
+
+// ps[] holds values cached by `prepare` for `pixel`
+typedef struct edata_rgba1_char4_time1_int2_char8 {
+    rgba_t cs[1];
+    uint8_t xs[4];
+    tick_t ts[1];
+    uint32_t ys[2];
+    uint8_t ps[8];
+} edata_rgba1_char4_time1_int2_char8;
+
 /* Effect functions
  *
  * void setup(Effect*, canpacket_t*)
  *  Called when the effect is first created. Space for data has been allocated, but not initialized
  *  The first argument is the effect struct.
  *
+ * void derive(Effect*)
+ *  Recomputes whatever `setup` works out from other fields (reciprocals, end times, ...), after
+ *  effect data was written in place by an automation track. Fields `prepare` or `tick` rewrite
+ *  on their own are left alone.
+ *
  * bool_t tick(Effect*, fractick_t) 
  *  Called on a 'tick', or fraction of a beat from 0-239. Tick 0 is *always* called once per beat.
  *  Return `CONTINUE` or `STOP`. `STOP` means the effect is done and can be removed from the stack.
@@ -53,8 +100,65 @@ typedef struct edata_rgba1_char4_time1 {
  *  Called when the controller recieves a message for an existing effect.
  *  The unmodified packet is sent as a second argument.
  *
+ * void prepare(Effect*, tick_t)
+ *  Called once per frame before any `pixel` call, with the time being rendered.
+ *  Stateless effects compute everything from (time - eff->start) here instead of
+ *  accumulating it in `tick`, so a frame can be rendered for any time, in any order.
+ *  Anything `pixel` would compute the same way for every pixel belongs here too.
+ *  Effects that only light part of the strip should narrow their extents with set_extent
+ *  (see bespeckle.h); `pixel` is then only called inside them.
+ *
  */
 
+// Reciprocal of STRIP_LENGTH for div_recip
+#define RECIP_STRIP_LENGTH (((uint32_t) 1 << RECIP_SHIFT) / STRIP_LENGTH)
+
+// Number of beats between the creation of the effect and `now`
+uint32_t _elapsed_beats(Effect* eff, tick_t now){
+    if(now.tick < eff->start.tick){
+        return 0;
+    }
+    return now.tick - eff->start.tick;
+}
+
+// derive - nothing is worked out from other fields
+void _derive_nothing(Effect* eff){
+}
+
+// derive - cs[1] is the inverse of cs[0]
+void _derive_stripe(Effect* eff){
+    edata_rgba2 *edata = (edata_rgba2*) eff->data;
+    edata->cs[1] = edata->cs[0];
+    edata->cs[1].r ^= 0xff;
+    edata->cs[1].g ^= 0xff;
+    edata->cs[1].b ^= 0xff;
+}
+
+// derive - ts[0] is the end time, xs[0] beats & xs[1] fracticks after the start
+void _derive_timeout(Effect* eff){
+    edata_rgba1_char4_time1 *edata = (edata_rgba1_char4_time1 *) eff->data;
+    edata->ts[0] = eff->start;
+    time_add(&(edata->ts[0]), edata->xs[0], edata->xs[1]);
+}
+
+// derive - Like _derive_timeout, but bit 7 of xs[0] is a direction flag, so only the low 7 bits
+//          count beats; ys[0] is the duration in fracticks & ys[1] its reciprocal
+void _derive_timeout_span(Effect* eff){
+    edata_rgba1_char4_time1_int2 *edata = (edata_rgba1_char4_time1_int2 *) eff->data;
+    edata->ts[0] = eff->start;
+    time_add(&(edata->ts[0]), edata->xs[0] & 0x7f, edata->xs[1]);
+    edata->ys[0] = (edata->xs[0] & 0x7f) * TICK_LENGTH + edata->xs[1];
+    edata->ys[1] = edata->ys[0] ? recip(edata->ys[0]) : 0;
+}
+
+// derive - ys[4] is the reciprocal of the period STRIP_LENGTH * rate, and ys[5] is
+//          rate % STRIP_LENGTH, so ticking pulses never divides
+void _derive_pulse_rate(Effect* eff){
+    edata_rgba1_char4_int6 *edata = (edata_rgba1_char4_int6 *) eff->data;
+    edata->ys[4] = recip(STRIP_LENGTH << (edata->xs[1] & 0x7));
+    edata->ys[5] = (1 << (edata->xs[1] & 0x7)) % STRIP_LENGTH;
+}
+
 // setup - Treat the data as an HSVA value, convert it to RGBA, and store it in the effect data
 void _setup_one_color(Effect* eff, canpacket_t* data){
     *(rgba_t*) eff->data = hsva_to_rgba(*(hsva_t*) (data->data));
@@ -62,6 +166,10 @@ void _setup_one_color(Effect* eff, canpacket_t* data){
 
 // setup - Copy the bytes from the packet into the effect data. Checks size! Zeros everything else
 void _setup_copy(Effect* eff, canpacket_t* data){
+    if(data->cmd == CMD_FRAG_COMMIT){
+        // Fragments already wrote all of the data in place
+        return;
+    }
     if(eff->table->size < CAN_DATA_SIZE){
         memcpy(eff->data, data->data, eff->table->size);
     }else{
@@ -71,11 +179,55 @@ void _setup_copy(Effect* eff, canpacket_t* data){
     }
 }
 
+// setup - Copy the packet like _setup_copy, then remember the starting values in xs[4:7]
+void _setup_copy_origin(Effect* eff, canpacket_t* data){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8*) eff->data;
+    _setup_copy(eff, data);
+    memcpy(edata->xs + 4, edata->xs, 4);
+}
+
+// setup - HSVA color like _setup_one_color; xs[0] remembers the starting alpha
+void _setup_flash(Effect* eff, canpacket_t* data){
+    edata_rgba1_char4 *edata = (edata_rgba1_char4*) eff->data;
+    _setup_one_color(eff, data);
+    edata->xs[0] = edata->cs[0].a;
+}
+
+// setup - HSVA color like _setup_one_color; cs[1] is the inverted color (see _derive_stripe)
+void _setup_stripe(Effect* eff, canpacket_t* data){
+    _setup_one_color(eff, data);
+    _derive_stripe(eff);
+}
+
+// setup - Copy the packet, then work out the end time (see _derive_timeout)
+void _setup_timeout(Effect* eff, canpacket_t* data){
+    _setup_copy(eff, data);
+    _derive_timeout(eff);
+}
+
+// setup - Copy the packet, then work out the end time & duration (see _derive_timeout_span)
+void _setup_timeout_span(Effect* eff, canpacket_t* data){
+    _setup_copy(eff, data);
+    _derive_timeout_span(eff);
+}
+
+// setup - Like _setup_timeout_span; xs[2] remembers the alpha to fade to/from
+void _setup_timeout_fade(Effect* eff, canpacket_t* data){
+    edata_rgba1_char4_time1_int2 *edata = (edata_rgba1_char4_time1_int2 *) eff->data;
+    _setup_timeout_span(eff, data);
+    edata->xs[2] = edata->cs[0].a;
+}
+
+// setup - Copy the packet, then work out the pulse period (see _derive_pulse_rate)
+void _setup_pulse_rate(Effect* eff, canpacket_t* data){
+    _setup_copy(eff, data);
+    _derive_pulse_rate(eff);
+}
+
 // setup - Setup pulse by 
 void _setup_pulse(Effect* eff, canpacket_t* data){
-    edata_rgba1_char4_int4 *edata = (edata_rgba1_char4_int4 *) eff->data;
-    memcpy(eff->data, data->data, CAN_DATA_SIZE);
-    memset(eff->data + CAN_DATA_SIZE, 0x00, eff->table->size - CAN_DATA_SIZE);
+    edata_rgba1_char4_int6 *edata = (edata_rgba1_char4_int6 *) eff->data;
+    _setup_pulse_rate(eff, data);
 
     edata->xs[0] = 1;
 
@@ -91,96 +243,39 @@ void _setup_pulse(Effect* eff, canpacket_t* data){
 }
     
 
-// tick - do nothing, never stop.
-bool_t _tick_nothing(Effect* eff, fractick_t ft){
-    return CONTINUE;
-}
-
-// tick - increment the first byte of the effect data, never stop
-bool_t _tick_increment(Effect* eff, fractick_t ft){
-    edata_char4 *edata = (edata_char4*)eff->data;
-    if(ft == 0){
-        edata->xs[0]++;
-    }
-    edata->xs[3] = ft;
-    return CONTINUE;
-}
-
-
-
-// tick - increment the 5th byte of the effect data mod STRIP_LENGTH, never stop
-// effect data holds an RGBA value followed by a counter
-bool_t _tick_inc_chase(Effect* eff, fractick_t ft){
-    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
-    if(ft == 0){
-        if(edata->xs[0] == 0 || edata->xs[0] + (edata->xs[1] & 0x7f) >= STRIP_LENGTH){
-            edata->xs[1] ^= 0x80;
-        }
-        edata->xs[0] += edata->xs[1] & 0x80 ? -1 : 1;
-    }
-    if(edata->xs[1] & 0x80){
-        edata->xs[2] = edata->cs[0].a * ft / 240;
-        edata->xs[3] = edata->cs[0].a - edata->xs[2];
-    }else{
-        edata->xs[3] = edata->cs[0].a * ft / 240;
-        edata->xs[2] = edata->cs[0].a - edata->xs[3];
-    }
-    return CONTINUE;
+// setup - Palette indices; xs[0] is the color, `prepare` looks it up into cs[0]
+void _setup_palette(Effect* eff, canpacket_t* data){
+    edata_rgba1_char4 *edata = (edata_rgba1_char4*) eff->data;
+    memcpy(edata->xs, data->data, 4);
 }
 
-bool_t _tick_inc_spr(Effect* eff, fractick_t ft){
-    edata_rgba1_char4 *edata = (edata_rgba1_char4 *) eff->data;
-    if(ft == 0){
-        if(edata->xs[0] >= STRIP_LENGTH){
-            edata->xs[0] = 0;
-        } else {
-            edata->xs[0]++;
-        }
-    }
-    return CONTINUE;
+// setup - Palette indices; xs[0] & xs[1] are the colors, `prepare` looks them up into cs[0] & cs[1]
+void _setup_palette2(Effect* eff, canpacket_t* data){
+    edata_rgba2_char4 *edata = (edata_rgba2_char4*) eff->data;
+    memcpy(edata->xs, data->data, 4);
 }
 
-// tick - flash the alpha channel on every beat, never stop
-bool_t _tick_flash(Effect* eff, fractick_t ft){
-    if(ft == 0){
-        rgba_t * rgba = (rgba_t*) eff->data;
-        rgba->a ^= 0xff;
-    }
-    return CONTINUE;
+// setup - Like _setup_copy_origin, but data[0] is a palette index, kept in ps[0]
+void _setup_palette_chase(Effect* eff, canpacket_t* data){
+    edata_rgba1_char8_char4 *edata = (edata_rgba1_char8_char4*) eff->data;
+    _setup_copy_origin(eff, data);
+    memset(edata->ps, 0x00, sizeof(edata->ps));
+    edata->ps[0] = data->data[0];
 }
 
-// tick - fade in. xs[1] controls rate; xs[0] is state after each beat; x[2] is the value
-bool_t _tick_fadein(Effect* eff, fractick_t ft){
-    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
-    uint8_t last_val = edata->xs[0];
-    int val;
-    // Approximate as 255 ticks/beat
-    // This is a good template for timing 
-    if(last_val != 0xff){
-        if(ft == 0){
-            edata->xs[0] += 0xff >> (edata->xs[1] & 0x7);
-        }
-        val = edata->xs[0] + (ft >> (edata->xs[1] & 0x7));
-
-        if(val >= 0xff || edata->xs[0] < last_val){
-            // Overflow; stop the fade 
-            edata->xs[0] = 0xff;
-            edata->xs[2] = 0xff;
-        }else{
-            edata->xs[2] = val & 0xff;
-        }
-    }
+// tick - do nothing, never stop.
+bool_t _tick_nothing(Effect* eff, fractick_t ft){
     return CONTINUE;
 }
 
 // tick - pulse. ys[0] is the state used by _pixel_pulse, ys[1] is the state since the last full beat. 
 //        xs[1] is the rate, xs[2] is the alpha for pixels where the pulse is
 bool_t _tick_pulse(Effect* eff, fractick_t ft){
-    edata_rgba1_char4_int4 *edata = (edata_rgba1_char4_int4 *) eff->data;
-    uint8_t rate = 1 << (edata->xs[1] & 0x7);
+    edata_rgba1_char4_int6 *edata = (edata_rgba1_char4_int6 *) eff->data;
+    uint32_t period = STRIP_LENGTH << (edata->xs[1] & 0x7);
     uint8_t mv;
     if(ft == 0){
-        mv = (0xff << 3) / (STRIP_LENGTH * rate);
+        mv = div_recip(0xff << 3, period, edata->ys[4]);
         if(edata->xs[1] & 0x8){
             edata->ys[2] <<= mv;
             edata->ys[2] |= (edata->ys[3] >> (32 - mv));
@@ -192,10 +287,10 @@ bool_t _tick_pulse(Effect* eff, fractick_t ft){
         }
         edata->ys[0] = edata->ys[2];
         edata->ys[1] = edata->ys[3];
-        edata->xs[2] = ((uint32_t) edata->cs[0].a * (0xff % (STRIP_LENGTH * rate)) / (STRIP_LENGTH * rate));
+        edata->xs[2] = div_recip(edata->cs[0].a * (0xff - div_recip(0xff, period, edata->ys[4]) * period), period, edata->ys[4]);
         //edata->xs[3] = edata->cs[0].a - edata->xs[2];
     }else{
-        mv = ((uint16_t) ft << 3) / (STRIP_LENGTH * rate);
+        mv = div_recip((uint16_t) ft << 3, period, edata->ys[4]);
         if(edata->xs[1] & 0x8){
             edata->ys[0] = edata->ys[2] << mv;
             edata->ys[1] = edata->ys[3] << mv;
@@ -212,18 +307,19 @@ bool_t _tick_pulse(Effect* eff, fractick_t ft){
             }
             //edata->ys[1] |= (edata->ys[2] << (31));
         }
-        edata->xs[2] = ((uint32_t) edata->cs[0].a * (ft % (STRIP_LENGTH * rate)) / (STRIP_LENGTH * rate));
+        edata->xs[2] = div_recip(edata->cs[0].a * (ft - div_recip(ft, period, edata->ys[4]) * period), period, edata->ys[4]);
         //edata->xs[3] = edata->cs[0].a - edata->xs[2];
     }
     return CONTINUE;
 }
 
 bool_t _tick_fadeacross(Effect* eff, fractick_t ft){
-    edata_rgba1_char4_int4 *edata = (edata_rgba1_char4_int4 *) eff->data;
-    uint8_t rate = 1 << (edata->xs[1] & 0x7);
+    edata_rgba1_char4_int6 *edata = (edata_rgba1_char4_int6 *) eff->data;
+    uint32_t period = STRIP_LENGTH << (edata->xs[1] & 0x7);
+    uint32_t phase;
     uint8_t l;
     if(ft == 0){
-        l = ((240 << 3) / (STRIP_LENGTH * rate));
+        l = div_recip(240 << 3, period, edata->ys[4]);
         if(edata->xs[1] & 0x8){
             for(; l; l--){
                 edata->ys[2] = edata->ys[2] | (edata->ys[2] << 1) | (edata->ys[3] >> 31);
@@ -238,7 +334,7 @@ bool_t _tick_fadeacross(Effect* eff, fractick_t ft){
         edata->ys[0] = edata->ys[2];
         edata->ys[1] = edata->ys[3];
     }else{
-        l = ((uint16_t) ft << 3) / (STRIP_LENGTH * rate);
+        l = div_recip((uint16_t) ft << 3, period, edata->ys[4]);
         edata->ys[0] = edata->ys[2];
         edata->ys[1] = edata->ys[3];
         if(edata->xs[1] & 0x8){
@@ -252,22 +348,15 @@ bool_t _tick_fadeacross(Effect* eff, fractick_t ft){
                 edata->ys[0] = edata->ys[0] | (edata->ys[0] >> 1);
             }
         }
-        edata->xs[2] = (((uint32_t) edata->cs[0].a * ((rate * ft) % STRIP_LENGTH)) / STRIP_LENGTH);
+        // (rate * ft) % STRIP_LENGTH
+        phase = edata->ys[5] * ft;
+        phase -= div_recip(phase, STRIP_LENGTH, RECIP_STRIP_LENGTH) * STRIP_LENGTH;
+        edata->xs[2] = div_recip(edata->cs[0].a * phase, STRIP_LENGTH, RECIP_STRIP_LENGTH);
         edata->xs[3] = edata->cs[0].a - edata->xs[2];
     }
     return CONTINUE;
 }
 
-// tick - strobes
-bool_t _tick_strobe(Effect* eff, fractick_t ft){
-    edata_rgba1_char4 *edata = (edata_rgba1_char4 *) eff->data;
-    edata->xs[2] = ft;
-    if(ft == 0){
-        edata->xs[3]++;
-    }
-    return CONTINUE;
-}
-
 // tick - decrement xs[0] for each fractick
 bool_t _tick_subdecrement(Effect* eff, fractick_t ft){
     edata_rgba1_char4 *edata = (edata_rgba1_char4 *) eff->data;
@@ -280,111 +369,303 @@ bool_t _tick_subdecrement(Effect* eff, fractick_t ft){
     return CONTINUE;
 }
 
-// tick - die if clock > time
+// tick - die once the clock passes the end time in ts[0] (see _setup_timeout)
 bool_t _tick_timeout(Effect* eff, fractick_t ft){
     edata_rgba1_char4_time1 *edata = (edata_rgba1_char4_time1 *) eff->data;
-    //if(((uint32_t) edata->ts[0]) > ((uint32_t) clock)){
-    if(!edata->xs[3]){
-        // Start
-        edata->ts[0].frac = clock.frac;
-        edata->ts[0].tick = clock.tick;
-        time_add(&(edata->ts[0]), edata->xs[0], edata->xs[1]);
-        edata->xs[3] = 1;
-    }else{
-        if(edata->ts[0].tick < clock.tick){
-            return STOP;
-        }else if(edata->ts[0].tick == clock.tick && edata->ts[0].frac < clock.frac){
-            return STOP;
-        }
+    if(time_sub(edata->ts[0], clock) < 0){
+        return STOP;
     }
     return CONTINUE;
 }
 
-bool_t _tick_timeout_scroll(Effect* eff, fractick_t ft){
-    edata_rgba1_char4_time1 *edata = (edata_rgba1_char4_time1 *) eff->data;
+// prepare - nothing is derived from the time
+void _prepare_nothing(Effect* eff, tick_t now){
+}
+
+// prepare - bring group xs[0] up to date; xs[3] is added to a pixel to find it in the group buffer
+// ys[0] copies the group's hash, so a group holding this layer re-renders when group xs[0] does
+void _prepare_group(Effect* eff, tick_t now){
+    edata_char4_int1 *edata = (edata_char4_int1*)eff->data;
+    if(edata->xs[0] < NUM_GROUPS){
+        render_group(edata->xs[0], now);
+        edata->ys[0] = groups[edata->xs[0]].hash;
+    }
+    edata->xs[3] = (STRIP_LENGTH - edata->xs[1] % STRIP_LENGTH) % STRIP_LENGTH;
+}
+
+// prepare - rainbow hue offset for this frame, stored in xs[3]. The hue moves xs[1] per beat
+void _prepare_rainbow(Effect* eff, tick_t now){
+    edata_char4 *edata = (edata_char4*)eff->data;
+    edata->xs[3] = (now.tick * edata->xs[1] + ((edata->xs[1] * now.frac) / TICK_LENGTH)) & 0xff;
+}
+
+// prepare - flash the alpha channel on every beat
+void _prepare_flash(Effect* eff, tick_t now){
+    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
+    edata->cs[0].a = edata->xs[0] ^ ((_elapsed_beats(eff, now) & 1) ? 0xff : 0x00);
+}
+
+// prepare - bounce a window of (xs[1] & 0x7f) pixels between the ends of the strip, one pixel per beat
+// xs[0] is the position and bit 0x80 of xs[1] the direction; xs[2] & xs[3] fade the leading & trailing pixels
+// xs[6] is the last pixel of the window
+void _prepare_chase(Effect* eff, tick_t now){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8*)eff->data;
+    uint8_t len = edata->xs[5] & 0x7f;
+    uint32_t span = (len < STRIP_LENGTH) ? STRIP_LENGTH - len : 0;
+    uint32_t phase;
+    uint8_t pos = 0;
+    bool_t down = edata->xs[5] & 0x80;
+
+    if(span){
+        // Unfold the bounce into a triangle wave of period 2 * span
+        phase = (edata->xs[4] < span) ? edata->xs[4] : span;
+        if(down && phase){
+            phase = 2 * span - phase;
+        }
+        phase = (phase + _elapsed_beats(eff, now)) % (2 * span);
+        pos = (phase <= span) ? phase : 2 * span - phase;
+        down = (phase == 0 || phase > span);
+    }
+    edata->xs[0] = pos;
+    edata->xs[1] = len | (down ? 0x80 : 0x00);
+    edata->xs[6] = pos + len;
+    set_extent(eff, pos, pos + len + 1);
+    if(down){
+        edata->xs[2] = edata->cs[0].a * now.frac / TICK_LENGTH;
+        edata->xs[3] = edata->cs[0].a - edata->xs[2];
+    }else{
+        edata->xs[3] = edata->cs[0].a * now.frac / TICK_LENGTH;
+        edata->xs[2] = edata->cs[0].a - edata->xs[3];
+    }
+}
+
+// prepare - grow xs[0] by one pixel per beat, wrapping after STRIP_LENGTH
+void _prepare_inc_spr(Effect* eff, tick_t now){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8 *) eff->data;
+    uint32_t beats = _elapsed_beats(eff, now);
+    uint8_t first;
+    if(beats == 0){
+        edata->xs[0] = edata->xs[4];
+        return;
+    }
+    first = (edata->xs[4] >= STRIP_LENGTH) ? 0 : edata->xs[4] + 1;
+    edata->xs[0] = (first + beats - 1) % (STRIP_LENGTH + 1);
+}
+
+// prepare - _prepare_inc_spr, with the extents drawn by _pixel_spr
+void _prepare_spr(Effect* eff, tick_t now){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8 *) eff->data;
+    _prepare_inc_spr(eff, now);
+    set_extent(eff, HALF_LENGTH - edata->xs[0] + 1, HALF_LENGTH + edata->xs[0]);
+}
+
+// prepare - _prepare_inc_spr, with the extents drawn by _pixel_shr
+void _prepare_shr(Effect* eff, tick_t now){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8 *) eff->data;
+    _prepare_inc_spr(eff, now);
+    set_extent(eff, HALF_LENGTH - edata->xs[0] + 1, STRIP_LENGTH);
+}
+
+// prepare - _prepare_inc_spr, with the extents drawn by _pixel_ltr
+void _prepare_ltr(Effect* eff, tick_t now){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8 *) eff->data;
+    _prepare_inc_spr(eff, now);
+    set_extent(eff, 0, edata->xs[0]);
+}
+
+// prepare - _prepare_inc_spr, with the extents drawn by _pixel_rtl
+void _prepare_rtl(Effect* eff, tick_t now){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8 *) eff->data;
+    _prepare_inc_spr(eff, now);
+    set_extent(eff, STRIP_LENGTH - edata->xs[0] + 1, STRIP_LENGTH);
+}
+
+// prepare - VU meter; lights xs[0] to xs[1]
+void _prepare_vu(Effect* eff, tick_t now){
+    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
+    set_extent(eff, edata->xs[0], edata->xs[1] + 1);
+}
+
+// prepare - nothing is lit while xs[0] is 0 (see _pixel_conditional_x1)
+void _prepare_conditional_x1(Effect* eff, tick_t now){
+    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
+    if(!edata->xs[0]){
+        set_extent(eff, 0, 0);
+    }
+}
+
+// prepare - fade in. xs[5] controls rate; xs[4] is the starting value; xs[2] is the value
+// Approximate as 255 ticks/beat, adding 0xff >> rate each beat
+// xs[6] is the alpha drawn by _pixel_solid_alpha2
+void _prepare_fadein(Effect* eff, tick_t now){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8*)eff->data;
+    uint8_t rate = edata->xs[5] & 0x7;
+    uint32_t beats = _elapsed_beats(eff, now);
+    uint32_t val = 0xff;
+
+    if(beats < 0x100){
+        val = edata->xs[4] + beats * (0xff >> rate);
+    }
+    if(val >= 0xff){
+        // Finished; stop the fade
+        edata->xs[0] = 0xff;
+        edata->xs[2] = 0xff;
+    }else{
+        edata->xs[0] = val;
+        val += now.frac >> rate;
+        edata->xs[2] = (val >= 0xff) ? 0xff : val;
+    }
+
+    edata->xs[6] = ((int) (edata->cs[0].a * edata->xs[2])) >> 8;
+    if(edata->xs[1] & 0x8){
+        // Fade in opposite direction
+        edata->xs[6] = 0xff - edata->xs[6];
+    }
+}
+
+// prepare - strobes. xs[2] is the fractick, xs[3] counts beats
+void _prepare_strobe(Effect* eff, tick_t now){
+    edata_rgba1_char4 *edata = (edata_rgba1_char4 *) eff->data;
+    edata->xs[2] = now.frac;
+    edata->xs[3] = _elapsed_beats(eff, now);
+}
+
+// prepare - strobe to pattern; nothing is lit outside xs[0] <= fractick < xs[1]
+void _prepare_strobe_range(Effect* eff, tick_t now){
+    edata_rgba1_char4 *edata = (edata_rgba1_char4 *) eff->data;
+    _prepare_strobe(eff, now);
+    if(!(edata->xs[0] <= edata->xs[2] && edata->xs[2] < edata->xs[1])){
+        set_extent(eff, 0, 0);
+    }
+}
+
+// prepare - strobes; xs[4] is set when the strobe is lit: every xs[1] beats, while xs[0] % fractick < 5
+// A rate of 0 in either place doesn't divide anything; that condition just holds
+void _prepare_strobe_on(Effect* eff, tick_t now){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8 *) eff->data;
+    _prepare_strobe(eff, now);
+    edata->xs[4] = (edata->xs[1] == 0 || edata->xs[3] % edata->xs[1] == 0) &&
+                   (edata->xs[2] == 0 || edata->xs[0] % edata->xs[2] < 5);
+    if(!edata->xs[4]){
+        set_extent(eff, 0, 0);
+    }
+}
+
+// Cache the pixels _pixel_er_pulse draws: ps[0]..ps[1] get the color, the pixel at ps[2] gets alpha
+// ps[3], and the pixel at ps[4] gets alpha ps[5]. 0xff is never on the strip, so it disables an edge
+void _prepare_er_pulse(Effect* eff){
+    edata_rgba1_char4_time1_int2_char8 *edata = (edata_rgba1_char4_time1_int2_char8 *) eff->data;
+    uint8_t target = edata->xs[3];
+    uint8_t before = target ? target - 1 : 0xff;
+    uint8_t after = (target < 0xfe) ? target + 1 : 0xff;
+
+    edata->ps[0] = target;
+    edata->ps[1] = target;
+    edata->ps[2] = 0xff;
+    edata->ps[3] = edata->xs[2];
+    edata->ps[4] = 0xff;
+    edata->ps[5] = edata->cs[0].a - edata->xs[2];
+    if(eff->table->eid == 0x42){
+        // Chaser
+        edata->ps[2] = after;
+        edata->ps[4] = before;
+        set_extent(eff, (int16_t) target - 1, (int16_t) target + 2);
+    }else if(edata->xs[0] & 0x80){
+        // Fade Across, backwards
+        edata->ps[1] = 0xff;
+        edata->ps[4] = before;
+        set_extent(eff, (int16_t) target - 1, STRIP_LENGTH);
+    }else{
+        // Fade Across
+        edata->ps[0] = 0;
+        edata->ps[2] = after;
+        set_extent(eff, 0, (int16_t) target + 2);
+    }
+}
+
+// prepare - position xs[3] of a scroll lasting until ts[0]; xs[2] is the alpha of the partial pixel
+void _prepare_timeout_scroll(Effect* eff, tick_t now){
+    edata_rgba1_char4_time1_int2 *edata = (edata_rgba1_char4_time1_int2 *) eff->data;
     int32_t time_left;
     int32_t time_total;
     int32_t t;
-    //if(((uint32_t) edata->ts[0]) > ((uint32_t) clock)){
-    if(!edata->xs[2]){
-        // Start
-        edata->ts[0].frac = clock.frac;
-        edata->ts[0].tick = clock.tick;
-        time_add(&(edata->ts[0]), edata->xs[0] & 0x7f, edata->xs[1]);
-    }
-    //if(edata->xs[3] > STRIP_LENGTH){
-    time_left = time_sub(edata->ts[0], clock); 
-    if(time_left < 0){
-        if(eff->table->eid == 0x42){
-            return STOP;
-        }else{
-            edata->xs[3] = (edata->xs[0] & 0x80) ? 0 : 0xff;
-            return CONTINUE;
-        }
+
+    time_left = time_sub(edata->ts[0], now); 
+    time_total = edata->ys[0];
+    if(time_left < 0 || time_total == 0){
+        edata->xs[3] = (edata->xs[0] & 0x80) ? 0 : 0xff;
+        _prepare_er_pulse(eff);
+        return;
+    }
+    if(time_left > time_total){
+        // Rendering a time before the effect started
+        time_left = time_total;
     }
 
-    time_total = (edata->xs[0] & 0x7f) * TICK_LENGTH + edata->xs[1];
-    
-    //DEBUG("clock: %d, %d\n", clock.tick, clock.frac);
-    //DEBUG("end: %d, %d, %d, %d\n", edata->ts[0].tick, edata->ts[0].frac, edata->xs[0], edata->xs[1]);
-    //DEBUG("time: %d, %d\n", time_left, time_total);
     if(edata->xs[0] & 0x80){
         t = time_left;
     }else{
         t = time_total - time_left;
     }
 
-    edata->xs[3] = (t * STRIP_LENGTH)  / time_total;
+    t *= STRIP_LENGTH;
+    edata->xs[3] = div_recip(t, time_total, edata->ys[1]);
     if(effects_running < EFFECTS_SLOWDOWN){
-        edata->xs[2] = (((t * STRIP_LENGTH) % time_total) * edata->cs[0].a) / time_total; 
+        edata->xs[2] = div_recip((t - edata->xs[3] * time_total) * edata->cs[0].a, time_total, edata->ys[1]);
     }else{
         edata->xs[2] = edata->cs[0].a;
     }
-    //edata->xs[2] = edata->cs[0].a;
     
     if(edata->xs[2] < 1){
         edata->xs[2] = 1;
     }
-    
-    return CONTINUE;
+    _prepare_er_pulse(eff);
 }
 
-bool_t _tick_timeout_fade(Effect* eff, fractick_t ft){
-    edata_rgba1_char4_time1 *edata = (edata_rgba1_char4_time1 *) eff->data;
+// prepare - fade the alpha between 0 and xs[2] until ts[0]
+void _prepare_timeout_fade(Effect* eff, tick_t now){
+    edata_rgba1_char4_time1_int2 *edata = (edata_rgba1_char4_time1_int2 *) eff->data;
     int32_t time_left;
     int32_t time_total;
     int32_t t;
-    //if(((uint32_t) edata->ts[0]) > ((uint32_t) clock)){
-    if(!edata->xs[2]){
-        // Start
-        edata->ts[0].frac = clock.frac;
-        edata->ts[0].tick = clock.tick;
-        time_add(&(edata->ts[0]), edata->xs[0] & 0x7f, edata->xs[1]);
-        edata->xs[2] = edata->cs[0].a;
-    }
-    time_left = time_sub(edata->ts[0], clock); 
-    if(edata->xs[3] == 0xff || time_left < 0){
-        edata->xs[3] = 0xff;
+
+    time_left = time_sub(edata->ts[0], now); 
+    time_total = edata->ys[0];
+    if(time_left < 0 || time_total == 0){
         edata->cs[0].a = (edata->xs[0] & 0x80) ? 0 : edata->xs[2];
-        return CONTINUE;
+        return;
+    }
+    if(time_left > time_total){
+        time_left = time_total;
     }
 
-    time_total = (edata->xs[0] & 0x7f) * TICK_LENGTH + edata->xs[1];
     if(edata->xs[0] & 0x80){
         t = time_left;
     }else{
         t = time_total - time_left;
     }
 
-    edata->cs[0].a = (t * edata->xs[2])  / time_total;
-    //edata->xs[2] = ((((time_total - time_left) * STRIP_LENGTH) % time_total) * edata->cs[0].a) / time_total; 
-    //edata->xs[2] = edata->cs[0].a;
-    
-    if(edata->xs[2] < 1){
-        edata->xs[2] = 1;
-    }
-    
-    return CONTINUE;
+    edata->cs[0].a = div_recip(t * edata->xs[2], time_total, edata->ys[1]);
+}
+
+// prepare - look up the color of palette entry xs[0]
+void _prepare_palette(Effect* eff, tick_t now){
+    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
+    edata->cs[0] = palette[edata->xs[0]];
+}
+
+// prepare - look up the colors of palette entries xs[0] & xs[1]
+void _prepare_palette2(Effect* eff, tick_t now){
+    edata_rgba2_char4 *edata = (edata_rgba2_char4*)eff->data;
+    edata->cs[0] = palette[edata->xs[0]];
+    edata->cs[1] = palette[edata->xs[1]];
+}
+
+// prepare - _prepare_chase in the color of palette entry ps[0]
+void _prepare_palette_chase(Effect* eff, tick_t now){
+    edata_rgba1_char8_char4 *edata = (edata_rgba1_char8_char4*)eff->data;
+    edata->cs[0] = palette[edata->ps[0]];
+    _prepare_chase(eff, now);
 }
 
 
@@ -393,43 +674,32 @@ rgba_t _pixel_solid(Effect* eff, position_t pos){
     return *((rgba_t*) eff->data);
 }
 
-// pixel - solid color across the strip: the first bytes of effect data; alpha controlled by xs[2]
+// pixel - solid color across the strip: the first bytes of effect data; alpha from xs[6] (see _prepare_fadein)
 rgba_t _pixel_solid_alpha2(Effect* eff, position_t pos){
-    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
+    edata_rgba1_char8 *edata = (edata_rgba1_char8*)eff->data;
     rgba_t out = edata->cs[0];
-    out.a = ((int) (out.a * edata->xs[2])) >> 8;
-    if(edata->xs[1] & 0x8){
-        // Fade in opposite direction
-        out.a = 0xff - out.a;
-    }
+    out.a = edata->xs[6];
     return out;
 }
 
 // pixel - similar to _pixel_solid, but with inverted colors every 3 pixels
 rgba_t _pixel_stripe(Effect* eff, position_t pos){
-    if(pos % 3){
-        rgba_t rgba = *((rgba_t*) eff->data);
-        rgba.r ^= 0xff;
-        rgba.g ^= 0xff;
-        rgba.b ^= 0xff;
-        return rgba;
-    }else{
-        return *((rgba_t*) eff->data);
-    }
+    edata_rgba2 *edata = (edata_rgba2*)eff->data;
+    return edata->cs[(pos % 3) ? 1 : 0];
 }
 
 // pixel - clear in most pixels, but the stored color at a given position (see _tick_inc_chase)
 rgba_t _pixel_chase(Effect* eff, position_t pos){
     const static rgba_t clear = {0,0,0,0};
-    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
+    edata_rgba1_char8 *edata = (edata_rgba1_char8*)eff->data;
     rgba_t color = edata->cs[0];
 
     if(pos == edata->xs[0]){
         color.a = edata->xs[2];
         return color;
-    }else if(pos > edata->xs[0] && pos < edata->xs[0] + (edata->xs[1] & 0x7f)){
+    }else if(pos > edata->xs[0] && pos < edata->xs[6]){
         return color;
-    }else if(pos == edata->xs[0] + (edata->xs[1] & 0x7f)){
+    }else if(pos == edata->xs[6]){
         color.a = edata->xs[3];
         return color;
     }
@@ -488,11 +758,18 @@ rgba_t _pixel_rainbow(Effect* eff, position_t pos){
     static hsva_t color = {0x00, 0xff, 0xff, 0xff};
     edata_char4 *edata = (edata_char4*)eff->data;
     //color.h = (edata->xs[0] * edata->xs[1] + (edata->xs[3] / edata->xs[1]) + pos * edata->xs[2]) & 0xff;
-    color.h = (clock.tick * edata->xs[1] + ((edata->xs[1] * TICK_LENGTH) / clock.frac) + pos * edata->xs[2]) & 0xff;
+    color.h = (edata->xs[3] + pos * edata->xs[2]) & 0xff;
     //color.h = pos;
     return hsva_to_rgba(color);
 }
 
+// pixel - palette sweep: entry xs[0] + xs[3] at the start, stepping xs[2] entries per pixel
+//         xs[3] moves xs[1] entries per beat (see _prepare_rainbow)
+rgba_t _pixel_palette_gradient(Effect* eff, position_t pos){
+    edata_char4 *edata = (edata_char4*)eff->data;
+    return palette[(edata->xs[0] + edata->xs[3] + pos * edata->xs[2]) & 0xff];
+}
+
 // pixel - color across the strip where xs[0] <= pos <= xs[1]. Useful for vu meter
 rgba_t _pixel_vu(Effect* eff, position_t pos){
     const static rgba_t clear = {0,0,0,0};
@@ -506,17 +783,11 @@ rgba_t _pixel_vu(Effect* eff, position_t pos){
 
 rgba_t _pixel_pulse(Effect* eff, position_t pos){
     const static rgba_t clear = {0,0,0,0};
-    edata_rgba1_char4_int4 *edata = (edata_rgba1_char4_int4*) eff->data;
-    //rgba_t color = edata->cs[0];
-    static rgba_t color;
+    edata_rgba1_char4_int6 *edata = (edata_rgba1_char4_int6*) eff->data;
+    rgba_t color = edata->cs[0];
     uint32_t cmp = edata->ys[(~(pos >> 5)) & 0x1];
     pos &= 0x1f;
 
-    color.r = edata->cs[0].r;
-    color.g = edata->cs[0].g;
-    color.b = edata->cs[0].b;
-    color.a = edata->cs[0].a;
-
     if(edata->xs[1] & 0x8){
         if(cmp & (1 << pos)){
             return color;
@@ -545,60 +816,49 @@ rgba_t _pixel_pulse(Effect* eff, position_t pos){
     return clear;
 }
 
+// pixel - the span & edges cached by _prepare_er_pulse
 rgba_t _pixel_er_pulse(Effect* eff, position_t pos){
     const static rgba_t clear = {0,0,0,0};
-    edata_rgba1_char4_time1 *edata = (edata_rgba1_char4_time1*) eff->data;
-    //rgba_t color = edata->cs[0];
-    static rgba_t color;
-    uint8_t target = edata->xs[3];
-
-    color.r = edata->cs[0].r;
-    color.g = edata->cs[0].g;
-    color.b = edata->cs[0].b;
-    color.a = edata->cs[0].a;
+    edata_rgba1_char4_time1_int2_char8 *edata = (edata_rgba1_char4_time1_int2_char8*) eff->data;
+    rgba_t color = edata->cs[0];
 
-    if(pos == target){
+    if(edata->ps[0] <= pos && pos <= edata->ps[1]){
         return color;
     }
-    if(eff->table->eid == 0x42){
-        // Chaser
-        if(pos == (target+1)){
-            color.a = edata->xs[2];
-            return color;
-        }
-        if(pos == (target-1)){
-            color.a -= edata->xs[2];
-            return color;
-        }
-    }else{
-        // Fade Across
-        if(edata->xs[0] & 0x80){
-            if(pos >= target){
-                return color;
-            }
-            if(pos == (target-1)){
-                color.a -= edata->xs[2];
-                return color;
-            }
-        }else{
-            if(pos < target){
-                return color;
-            }
-            if(pos == (target+1)){
-                color.a = edata->xs[2];
-                return color;
-            }
-        }
+    if(pos == edata->ps[2]){
+        color.a = edata->ps[3];
+        return color;
+    }
+    if(pos == edata->ps[4]){
+        color.a = edata->ps[5];
+        return color;
     }
     return clear;
 }
 
 
-// pixel - strobe solid color across the strip
+// pixel - the cached buffer of group xs[0], shifted along by xs[1] pixels; reversed if xs[2] & 0x1
+rgba_t _pixel_group(Effect* eff, position_t pos){
+    const static rgba_t clear = {0,0,0,0};
+    edata_char4_int1 *edata = (edata_char4_int1*)eff->data;
+    uint16_t src = pos + edata->xs[3];
+    if(edata->xs[0] >= NUM_GROUPS){
+        return clear;
+    }
+    if(src >= STRIP_LENGTH){
+        src -= STRIP_LENGTH;
+    }
+    if(edata->xs[2] & 0x1){
+        src = STRIP_LENGTH - 1 - src;
+    }
+    return groups[edata->xs[0]].buffer[src];
+}
+
+// pixel - strobe solid color across the strip (see _prepare_strobe_on)
 rgba_t _pixel_strobe(Effect* eff, position_t pos){
     const static rgba_t clear = {0,0,0,0};
-    edata_rgba1_char4 *edata = (edata_rgba1_char4*)eff->data;
-    if(edata->xs[3] % edata->xs[1] == 0 && (edata->xs[0] % edata->xs[2]) < 5){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8*)eff->data;
+    if(edata->xs[4]){
         return edata->cs[0];
     }
     return clear;
@@ -655,6 +915,15 @@ bool_t _msg_copy(Effect* eff, canpacket_t* data){
     return CONTINUE;
 }
 
+// msg - copy data bytes over the effect data and restart the effect from them (see _setup_copy_origin)
+bool_t _msg_copy_origin(Effect* eff, canpacket_t* data){
+    edata_rgba1_char8 *edata = (edata_rgba1_char8*) eff->data;
+    _msg_copy(eff, data);
+    memcpy(edata->xs + 4, edata->xs, 4);
+    eff->start = clock;
+    return CONTINUE;
+}
+
 // msg - copy data bytes over the effect data 
 bool_t _msg_copytick(Effect* eff, canpacket_t* data){
     // data->data[0:3] RGBA color
@@ -669,7 +938,7 @@ bool_t _msg_copytick(Effect* eff, canpacket_t* data){
 }
 
 bool_t _msg_pulse(Effect* eff, canpacket_t* data){
-    edata_rgba1_char4_int4 *edata = (edata_rgba1_char4_int4*) eff->data;
+    edata_rgba1_char4_int6 *edata = (edata_rgba1_char4_int6*) eff->data;
     uint32_t mask = (1 << (data->data[0] + 1)) - 1;
 
     /*
@@ -710,68 +979,197 @@ bool_t _msg_strobe(Effect* eff, canpacket_t* data){
 
 /* End Effect Functions */
 
+/* Fused kernels
+ * Each kernel is a copy of the generic compose loop for one fixed stack of `pixel` functions.
+ * The calls are direct, so the compiler can inline the pixel bodies & mixing into one loop.
+ * FUSED_KERNELS lists the stacks we actually use, bottom layer first; add new ones there.
+ * A kernel is only built if every one of its pixel functions is drawn by an effect in the build.
+ */
+
+// FUSED_USES_<pixel> is 1 if an effect in the catalogue that is built draws with `pixel`
+#if EFFECT_0x00 || EFFECT_0x01 || EFFECT_0x10 || EFFECT_0x40 || EFFECT_0x43 || EFFECT_0x60
+#define FUSED_USES__pixel_solid 1
+#else
+#define FUSED_USES__pixel_solid 0
+#endif
+#define FUSED_USES__pixel_solid_alpha2 EFFECT_0x12
+#if EFFECT_0x02 || EFFECT_0x61
+#define FUSED_USES__pixel_stripe 1
+#else
+#define FUSED_USES__pixel_stripe 0
+#endif
+#define FUSED_USES__pixel_rainbow EFFECT_0x03
+#if EFFECT_0x04 || EFFECT_0x62
+#define FUSED_USES__pixel_chase 1
+#else
+#define FUSED_USES__pixel_chase 0
+#endif
+#define FUSED_USES__pixel_vu EFFECT_0x05
+#define FUSED_USES__pixel_spr EFFECT_0x06
+#define FUSED_USES__pixel_shr EFFECT_0x07
+#define FUSED_USES__pixel_ltr EFFECT_0x08
+#define FUSED_USES__pixel_rtl EFFECT_0x09
+#if EFFECT_0x14 || EFFECT_0x16
+#define FUSED_USES__pixel_pulse 1
+#else
+#define FUSED_USES__pixel_pulse 0
+#endif
+#if EFFECT_0x41 || EFFECT_0x42
+#define FUSED_USES__pixel_er_pulse 1
+#else
+#define FUSED_USES__pixel_er_pulse 0
+#endif
+#define FUSED_USES__pixel_strobe EFFECT_0x18
+#define FUSED_USES__pixel_conditional_range EFFECT_0x20
+#define FUSED_USES__pixel_conditional_x1 EFFECT_0x21
+
+// FUSED_<n>(K, layers...) expands to K(layers...) when every layer is used, like EFFECT_ROW
+#define FUSED_IF(a) EFFECT_IF(FUSED_USES_##a)
+#define FUSED_1(K, a)       FUSED_IF(a)(K(a))
+#define FUSED_2(K, a, b)    FUSED_IF(a)(FUSED_IF(b)(K(a, b)))
+#define FUSED_3(K, a, b, c) FUSED_IF(a)(FUSED_IF(b)(FUSED_IF(c)(K(a, b, c))))
+
+#define FUSED_KERNELS(K1, K2, K3) \
+    FUSED_1(K1, _pixel_solid) \
+    FUSED_1(K1, _pixel_solid_alpha2) \
+    FUSED_1(K1, _pixel_stripe) \
+    FUSED_1(K1, _pixel_rainbow) \
+    FUSED_1(K1, _pixel_chase) \
+    FUSED_1(K1, _pixel_vu) \
+    FUSED_1(K1, _pixel_spr) \
+    FUSED_1(K1, _pixel_shr) \
+    FUSED_1(K1, _pixel_ltr) \
+    FUSED_1(K1, _pixel_rtl) \
+    FUSED_1(K1, _pixel_pulse) \
+    FUSED_1(K1, _pixel_er_pulse) \
+    FUSED_1(K1, _pixel_strobe) \
+    FUSED_1(K1, _pixel_conditional_range) \
+    FUSED_1(K1, _pixel_conditional_x1) \
+    FUSED_2(K2, _pixel_solid, _pixel_strobe) \
+    FUSED_2(K2, _pixel_solid, _pixel_chase) \
+    FUSED_2(K2, _pixel_solid, _pixel_vu) \
+    FUSED_2(K2, _pixel_solid, _pixel_er_pulse) \
+    FUSED_2(K2, _pixel_solid, _pixel_solid) \
+    FUSED_2(K2, _pixel_rainbow, _pixel_strobe) \
+    FUSED_2(K2, _pixel_rainbow, _pixel_chase) \
+    FUSED_3(K3, _pixel_solid, _pixel_strobe, _pixel_chase) \
+    FUSED_3(K3, _pixel_solid, _pixel_chase, _pixel_strobe) \
+    FUSED_3(K3, _pixel_solid, _pixel_vu, _pixel_strobe) \
+    FUSED_3(K3, _pixel_rainbow, _pixel_chase, _pixel_strobe)
+
+#define FUSED_KERNEL_1(a) \
+void _fused_##a(Effect* e0, rgb_t* strip){ \
+    position_t i; \
+    for(i = 0; i < STRIP_LENGTH; i++){ \
+        strip[i] = mix_rgb(a(e0, i), RGB_EMPTY); \
+    } \
+}
+
+#define FUSED_KERNEL_2(a, b) \
+void _fused_##a##__##b(Effect* e0, rgb_t* strip){ \
+    Effect* e1 = e0->next; \
+    position_t i; \
+    for(i = 0; i < STRIP_LENGTH; i++){ \
+        strip[i] = mix_rgb(b(e1, i), mix_rgb(a(e0, i), RGB_EMPTY)); \
+    } \
+}
+
+#define FUSED_KERNEL_3(a, b, c) \
+void _fused_##a##__##b##__##c(Effect* e0, rgb_t* strip){ \
+    Effect* e1 = e0->next; \
+    Effect* e2 = e1->next; \
+    position_t i; \
+    for(i = 0; i < STRIP_LENGTH; i++){ \
+        strip[i] = mix_rgb(c(e2, i), mix_rgb(b(e1, i), mix_rgb(a(e0, i), RGB_EMPTY))); \
+    } \
+}
+
+#define FUSED_ENTRY_1(a)       {1, {a, NULL, NULL}, _fused_##a},
+#define FUSED_ENTRY_2(a, b)    {2, {a, b, NULL},    _fused_##a##__##b},
+#define FUSED_ENTRY_3(a, b, c) {3, {a, b, c},       _fused_##a##__##b##__##c},
+
+FUSED_KERNELS(FUSED_KERNEL_1, FUSED_KERNEL_2, FUSED_KERNEL_3)
+
+FusedKernel const fused_kernels[] = {
+    FUSED_KERNELS(FUSED_ENTRY_1, FUSED_ENTRY_2, FUSED_ENTRY_3)
+    {0, {NULL, NULL, NULL}, NULL}
+};
+
 /* Effect Table containing all the possible effects & their virtual functions
  * id - effect id. enables a device to not implement a particular effect. must be unique
  * size - size of `data` array in the effect struct. How much data does the effect need?
- * setup, tick, pixel, msg - functions, as described above
- *
- *  id  size                          setup             tick             pixel           msg
+ * setup, derive, tick, pixel, msg, prepare - functions, as described above
+ * cost - render cost per pixel relative to a solid color, for admission control
+ * The rows are EFFECT_CATALOGUE in effects.h, minus the ones this build leaves out
  */
+#define EFFECT_ENTRY(eid, size, setup, derive, tick, pixel, msg, prepare, cost) \
+    {eid, size, setup, derive, tick, pixel, msg, prepare, cost},
+
 EffectTable const effect_table[NUM_EFFECTS] = {
-    // Solid color 
-    {0, sizeof(rgba_t),               _setup_one_color, _tick_nothing,   _pixel_solid,   _msg_stop},
-    // Flash solid                   
-    {1, sizeof(rgba_t),               _setup_one_color, _tick_flash,     _pixel_solid,   _msg_stop},
-    // Stripes                       
-    {2, sizeof(rgba_t),               _setup_one_color, _tick_nothing,   _pixel_stripe,  _msg_stop},
-    // Rainbow!                      
-    {3, 6,                            _setup_copy,      _tick_increment, _pixel_rainbow, _msg_stop},
-    // Chase
-    {4, sizeof(edata_rgba1_char4),    _setup_copy,      _tick_inc_chase, _pixel_chase,   _msg_stop},
-    // VU meter
-    {5, sizeof(edata_rgba1_char4),    _setup_copy,      _tick_nothing, _pixel_vu,   _msg_store_char4},
-    // expand
-    {6, sizeof(edata_rgba1_char4),    _setup_copy,      _tick_inc_spr, _pixel_spr,   _msg_stop},
-	//  shrink
-	{7, sizeof(edata_rgba1_char4),    _setup_copy,      _tick_inc_spr, _pixel_shr, _msg_stop}, 
-	// ltr
-	{8, sizeof(edata_rgba1_char4),    _setup_copy,      _tick_inc_spr, _pixel_ltr,    _msg_stop}, 
-	//rtl
-    {9, sizeof(edata_rgba1_char4),    _setup_copy,      _tick_inc_spr, _pixel_rtl,    _msg_stop}, 
-	// scattering
-	//{10, sizeof(edata_rgba1_char4),   _setup_copy,      _tick_flash,   _pixel_scat,   _msg_stop), 
-	// slide in left(pos)+stop
-	//slide in right
-	//dashed line ltr
-	
-	//give all signal for colorchange, speedchange
-    // Solid color; RGBA; msg changes color
-    {0x10, sizeof(rgba_t),               _setup_copy, _tick_nothing,   _pixel_solid,   _msg_copy},
-    // Fade in/out; RGBA; msg changes color; data[5] is start, data[6] is 'rate' & direction
-    {0x12, sizeof(edata_rgba1_char4),    _setup_copy, _tick_fadein,    _pixel_solid_alpha2,   _msg_copy},
-    // Pulse; RGBA; msg sends pulse; data[5] is nothing, data[6] is 'rate' & direction
-    {0x14, sizeof(edata_rgba1_char4_int4), _setup_copy, _tick_pulse,    _pixel_pulse,   _msg_pulse},
-    // Fade across; RGBA; msg changes color & sends pulse; data[5] is nothing, data[6] is 'rate' & direction
-    // Not efficiently implemented, but lets us reuse a lot of code
-    {0x16, sizeof(edata_rgba1_char4_int4), _setup_pulse, _tick_fadeacross,    _pixel_pulse,   _msg_pulse},
-
-    // Strobe; RGBA; msg changes color/rate
-    {0x18, sizeof(edata_rgba1_char4), _setup_copy, _tick_strobe, _pixel_strobe, _msg_strobe},
-    // Strobe to pattern; RGBA; msg sets color, on & off times
-    {0x20, sizeof(edata_rgba1_char4), _setup_copy, _tick_strobe, _pixel_conditional_range, _msg_copy},
-    // Solid color for n ticks; msg sets color & on time
-    {0x21, sizeof(edata_rgba1_char4), _setup_copy, _tick_subdecrement, _pixel_conditional_x1, _msg_copy},
-
-
-
-    // Synchronous events that @ervanalb wants
-    // Strobe
-    {0x40, sizeof(edata_rgba1_char4_time1), _setup_copy, _tick_timeout, _pixel_solid, _msg_stop},
-    // Fade across
-    {0x41, sizeof(edata_rgba1_char4_time1), _setup_copy, _tick_timeout_scroll, _pixel_er_pulse, _msg_stop},
-    // Chaser
-    {0x42, sizeof(edata_rgba1_char4_time1), _setup_copy, _tick_timeout_scroll, _pixel_er_pulse, _msg_stop},
-    // Fade in
-    {0x43, sizeof(edata_rgba1_char4_time1), _setup_copy, _tick_timeout_fade, _pixel_solid, _msg_stop},
+    EFFECT_CATALOGUE(EFFECT_ENTRY)
 };
 
+/* Dispatch */
+
+#define EFFECT_TICK_CASE(eid, size, setup, derive, tick, pixel, msg, prepare, cost) \
+    case eid: \
+        return tick(eff, ft);
+
+#define EFFECT_PREPARE_CASE(eid, size, setup, derive, tick, pixel, msg, prepare, cost) \
+    case eid: \
+        prepare(eff, now); \
+    break;
+
+#define EFFECT_LAYER_LOOP(eid, size, setup, derive, tick, pixel, msg, prepare, cost) \
+void _layer_##eid(Effect* eff, rgba_t* layer, position_t lo, position_t hi){ \
+    position_t i; \
+    for(i = lo; i < hi; i++){ \
+        layer[i] = pixel(eff, i); \
+    } \
+}
+
+#define EFFECT_LAYER_CASE(eid, size, setup, derive, tick, pixel, msg, prepare, cost) \
+    case eid: \
+        _layer_##eid(eff, layer, lo, hi); \
+    break;
+
+EFFECT_CATALOGUE(EFFECT_LAYER_LOOP)
+
+bool_t effect_tick(Effect* eff, fractick_t ft){
+    switch(eff->table->eid){
+        EFFECT_CATALOGUE(EFFECT_TICK_CASE)
+    }
+    return CONTINUE;
+}
+
+void effect_prepare(Effect* eff, tick_t now){
+    switch(eff->table->eid){
+        EFFECT_CATALOGUE(EFFECT_PREPARE_CASE)
+    }
+}
+
+void effect_layer(Effect* eff, rgba_t* layer, position_t lo, position_t hi){
+    switch(eff->table->eid){
+        EFFECT_CATALOGUE(EFFECT_LAYER_CASE)
+    }
+}
+
+#ifdef TICK_BY_TYPE
+// The types are in table order, so `i` runs on from one type's loop into the next
+#define EFFECT_TICK_TYPE(eid, size, setup, derive, tick, pixel, msg, prepare, cost) \
+    for(t++; i < start[t]; i++){ \
+        if(tick(ticking[i], ft)){ \
+            stopped[ticking[i] - effects_heap] = 1; \
+            any = 1; \
+        } \
+    }
+
+bool_t effect_tick_types(Effect* const* ticking, const uint8_t* start, fractick_t ft, bool_t* stopped){
+    bool_t any = 0;
+    uint8_t t = 0;
+    uint8_t i = start[0];
+    EFFECT_CATALOGUE(EFFECT_TICK_TYPE)
+    return any;
+}
+#endif
+
@@ -2,18 +2,191 @@
 #ifndef __EFFECTS_H__
 #define __EFFECTS_H__
 
-// Number of effects 
-#define NUM_EFFECTS  21
+/* Effect catalogue
+ * Every effect a build can run, one row each: id, size, setup, derive, tick, pixel, msg, prepare, cost
+ * (see effect_table in effects.c). The table & the switch dispatch below are generated from it.
+ * Each row is only built if EFFECT_<id> is 1; ids that aren't set default to EFFECTS_DEFAULT.
+ * A fixture that only uses a few effects can build just those, e.g. for a smaller image:
+ *  -DEFFECTS_DEFAULT=0 -DEFFECT_0x10=1 -DEFFECT_0x14=1 -DEFFECT_0x40=1
+ * The fused kernels in effects.c follow: only those whose layers are all drawn by a built
+ * effect are kept. A new pixel function needs its FUSED_USES_ line there too.
+ */
+#define EFFECT_CATALOGUE(X) \
+    /* Solid color */ \
+    EFFECT_ROW(X, 0x00, sizeof(rgba_t),            _setup_one_color, _derive_nothing, _tick_nothing, _pixel_solid, _msg_stop, _prepare_nothing, 1) \
+    /* Flash solid */ \
+    EFFECT_ROW(X, 0x01, sizeof(edata_rgba1_char4), _setup_flash, _derive_nothing, _tick_nothing, _pixel_solid, _msg_stop, _prepare_flash, 1) \
+    /* Stripes */ \
+    EFFECT_ROW(X, 0x02, sizeof(edata_rgba2),       _setup_stripe, _derive_stripe, _tick_nothing, _pixel_stripe, _msg_stop, _prepare_nothing, 2) \
+    /* Rainbow! */ \
+    EFFECT_ROW(X, 0x03, 6,                         _setup_copy, _derive_nothing, _tick_nothing, _pixel_rainbow, _msg_stop, _prepare_rainbow, 8) \
+    /* Chase */ \
+    EFFECT_ROW(X, 0x04, sizeof(edata_rgba1_char8), _setup_copy_origin, _derive_nothing, _tick_nothing, _pixel_chase, _msg_stop, _prepare_chase, 2) \
+    /* VU meter */ \
+    EFFECT_ROW(X, 0x05, sizeof(edata_rgba1_char4), _setup_copy, _derive_nothing, _tick_nothing, _pixel_vu, _msg_store_char4, _prepare_vu, 2) \
+    /* expand */ \
+    EFFECT_ROW(X, 0x06, sizeof(edata_rgba1_char8), _setup_copy_origin, _derive_nothing, _tick_nothing, _pixel_spr, _msg_stop, _prepare_spr, 2) \
+    /* shrink */ \
+    EFFECT_ROW(X, 0x07, sizeof(edata_rgba1_char8), _setup_copy_origin, _derive_nothing, _tick_nothing, _pixel_shr, _msg_stop, _prepare_shr, 2) \
+    /* ltr */ \
+    EFFECT_ROW(X, 0x08, sizeof(edata_rgba1_char8), _setup_copy_origin, _derive_nothing, _tick_nothing, _pixel_ltr, _msg_stop, _prepare_ltr, 2) \
+    /* rtl */ \
+    EFFECT_ROW(X, 0x09, sizeof(edata_rgba1_char8), _setup_copy_origin, _derive_nothing, _tick_nothing, _pixel_rtl, _msg_stop, _prepare_rtl, 2) \
+    /* Solid color; RGBA; msg changes color */ \
+    EFFECT_ROW(X, 0x10, sizeof(rgba_t),            _setup_copy, _derive_nothing, _tick_nothing, _pixel_solid, _msg_copy, _prepare_nothing, 1) \
+    /* Fade in/out; RGBA; msg changes color & restarts; data[5] is start, data[6] is 'rate' & direction */ \
+    EFFECT_ROW(X, 0x12, sizeof(edata_rgba1_char8), _setup_copy_origin, _derive_nothing, _tick_nothing, _pixel_solid_alpha2, _msg_copy_origin, _prepare_fadein, 2) \
+    /* Pulse; RGBA; msg sends pulse; data[5] is nothing, data[6] is 'rate' & direction */ \
+    /* Pulses arrive as messages, so this one still keeps its state in `tick` */ \
+    EFFECT_ROW(X, 0x14, sizeof(edata_rgba1_char4_int6), _setup_pulse_rate, _derive_pulse_rate, _tick_pulse, _pixel_pulse, _msg_pulse, _prepare_nothing, 3) \
+    /* Fade across; RGBA; msg changes color & sends pulse; data[5] is nothing, data[6] is 'rate' & direction */ \
+    /* Not efficiently implemented, but lets us reuse a lot of code */ \
+    EFFECT_ROW(X, 0x16, sizeof(edata_rgba1_char4_int6), _setup_pulse, _derive_pulse_rate, _tick_fadeacross, _pixel_pulse, _msg_pulse, _prepare_nothing, 3) \
+    /* Strobe; RGBA; msg changes color/rate */ \
+    EFFECT_ROW(X, 0x18, sizeof(edata_rgba1_char8), _setup_copy, _derive_nothing, _tick_nothing, _pixel_strobe, _msg_strobe, _prepare_strobe_on, 2) \
+    /* Strobe to pattern; RGBA; msg sets color, on & off times */ \
+    EFFECT_ROW(X, 0x20, sizeof(edata_rgba1_char4), _setup_copy, _derive_nothing, _tick_nothing, _pixel_conditional_range, _msg_copy, _prepare_strobe_range, 2) \
+    /* Solid color for n ticks; msg sets color & on time */ \
+    /* Measures the spacing between syncs, so it stays in `tick` */ \
+    EFFECT_ROW(X, 0x21, sizeof(edata_rgba1_char4), _setup_copy, _derive_nothing, _tick_subdecrement, _pixel_conditional_x1, _msg_copy, _prepare_conditional_x1, 2) \
+    /* Synchronous events that @ervanalb wants */ \
+    /* Strobe */ \
+    EFFECT_ROW(X, 0x40, sizeof(edata_rgba1_char4_time1), _setup_timeout, _derive_timeout, _tick_timeout, _pixel_solid, _msg_stop, _prepare_nothing, 1) \
+    /* Fade across */ \
+    EFFECT_ROW(X, 0x41, sizeof(edata_rgba1_char4_time1_int2_char8), _setup_timeout_span, _derive_timeout_span, _tick_nothing, _pixel_er_pulse, _msg_stop, _prepare_timeout_scroll, 3) \
+    /* Chaser */ \
+    EFFECT_ROW(X, 0x42, sizeof(edata_rgba1_char4_time1_int2_char8), _setup_timeout_span, _derive_timeout_span, _tick_timeout, _pixel_er_pulse, _msg_stop, _prepare_timeout_scroll, 3) \
+    /* Fade in */ \
+    EFFECT_ROW(X, 0x43, sizeof(edata_rgba1_char4_time1_int2), _setup_timeout_fade, _derive_timeout_span, _tick_nothing, _pixel_solid, _msg_stop, _prepare_timeout_fade, 1) \
+    /* Layer group; data[0] is the group, data[1] the offset along the strip, data[2] & 0x1 reverses */ \
+    /* Several of these can show the same group; it is only rendered once per frame */ \
+    EFFECT_ROW(X, 0x50, sizeof(edata_char4_int1),  _setup_copy, _derive_nothing, _tick_nothing, _pixel_group, _msg_copy, _prepare_group, 2) \
+    /* Palette colors; data[0] (& data[1]) are palette indices, so one CMD_PALETTE recolors them all */ \
+    /* Solid */ \
+    EFFECT_ROW(X, 0x60, sizeof(edata_rgba1_char4), _setup_palette, _derive_nothing, _tick_nothing, _pixel_solid, _msg_stop, _prepare_palette, 1) \
+    /* Stripe of data[0] & data[1] */ \
+    EFFECT_ROW(X, 0x61, sizeof(edata_rgba2_char4), _setup_palette2, _derive_nothing, _tick_nothing, _pixel_stripe, _msg_stop, _prepare_palette2, 2) \
+    /* Chase; data[4] & data[5] as for 0x04 */ \
+    EFFECT_ROW(X, 0x62, sizeof(edata_rgba1_char8_char4), _setup_palette_chase, _derive_nothing, _tick_nothing, _pixel_chase, _msg_stop, _prepare_palette_chase, 2) \
+    /* Gradient; data[1] is the rate & data[2] the step per pixel, as for rainbow */ \
+    EFFECT_ROW(X, 0x63, sizeof(edata_char4),       _setup_copy, _derive_nothing, _tick_nothing, _pixel_palette_gradient, _msg_stop, _prepare_rainbow, 2)
 
-#define EFFECTS_SLOWDOWN 9
+#ifndef EFFECTS_DEFAULT
+#define EFFECTS_DEFAULT 1
+#endif
 
-#ifndef STRIP_LENGTH
-// Length of LED strip
-// sizeof(position_t) > STRIP_LENGTH
-#define STRIP_LENGTH 50
+#ifndef EFFECT_0x00
+#define EFFECT_0x00 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x01
+#define EFFECT_0x01 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x02
+#define EFFECT_0x02 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x03
+#define EFFECT_0x03 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x04
+#define EFFECT_0x04 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x05
+#define EFFECT_0x05 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x06
+#define EFFECT_0x06 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x07
+#define EFFECT_0x07 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x08
+#define EFFECT_0x08 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x09
+#define EFFECT_0x09 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x10
+#define EFFECT_0x10 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x12
+#define EFFECT_0x12 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x14
+#define EFFECT_0x14 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x16
+#define EFFECT_0x16 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x18
+#define EFFECT_0x18 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x20
+#define EFFECT_0x20 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x21
+#define EFFECT_0x21 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x40
+#define EFFECT_0x40 EFFECTS_DEFAULT
 #endif
+#ifndef EFFECT_0x41
+#define EFFECT_0x41 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x42
+#define EFFECT_0x42 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x43
+#define EFFECT_0x43 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x50
+#define EFFECT_0x50 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x60
+#define EFFECT_0x60 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x61
+#define EFFECT_0x61 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x62
+#define EFFECT_0x62 EFFECTS_DEFAULT
+#endif
+#ifndef EFFECT_0x63
+#define EFFECT_0x63 EFFECTS_DEFAULT
+#endif
+
+// EFFECT_ROW expands to X(row) when the row's EFFECT_<id> is 1, and to nothing when it is 0
+#define EFFECT_ROW(X, eid, ...) EFFECT_IF(EFFECT_##eid)(X(eid, __VA_ARGS__))
+#define EFFECT_IF(enabled) EFFECT_PASTE(EFFECT_IF_, enabled)
+#define EFFECT_PASTE(a, b) a##b
+#define EFFECT_IF_0(row)
+#define EFFECT_IF_1(row) row
+
+#define EFFECT_COUNT(eid, ...) + 1
+
+// Number of effects in this build
+#define NUM_EFFECTS  (0 EFFECT_CATALOGUE(EFFECT_COUNT))
+
+#define EFFECTS_SLOWDOWN 9
 
 
 extern EffectTable const effect_table[];
 
+// Switch dispatch over the catalogue, for the hot paths: each case calls the effect's function
+// directly, so the compiler can inline it. The same as calling through eff->table
+bool_t effect_tick(Effect*, fractick_t);
+void effect_prepare(Effect*, tick_t);
+// Renders pixels [lo, hi) of `layer`, in one loop per effect type
+void effect_layer(Effect*, rgba_t*, position_t, position_t);
+
+#ifdef TICK_BY_TYPE
+extern Effect effects_heap[EFFECTS_HEAP_SIZE];
+
+// Ticks the effects in `ticking`, type t being [start[t], start[t + 1]), in one loop per type
+// that calls its tick function directly; flags stopped ones by heap slot. True if any stopped
+bool_t effect_tick_types(Effect* const*, const uint8_t*, fractick_t, bool_t*);
+#endif
+
+// Fused kernels for common stacks; terminated by an entry with 0 layers
+extern FusedKernel const fused_kernels[];
+
 #endif /* __EFFECTS_H__ */
@@ -0,0 +1,703 @@
+/* Offline renderer
+ * Plays a packet capture through the engine and writes every frame, much faster than real time
+ *
+ *  $ gcc render.c -Wall -O3 -o render
+ *  $ ./render [-f ppm|raw] [-j jobs] [-c beats] [-p depth] [-t trace.json] capture.bin out.ppm
+ *
+ * The capture is a stream of 8 byte packets: cmd uid data[6], as they were sent on the bus.
+ * A frame is rendered after every CMD_SYNC & CMD_TICK, i.e. whenever the clock moves.
+ *  ppm: one image, one row of PHYSICAL_LENGTH pixels per frame (time runs down the image)
+ *  raw: RGB24 frames back to back, e.g. for ffmpeg -f rawvideo -pix_fmt rgb24 -s <length>x1
+ * "-" reads the capture from stdin / writes to stdout
+ *
+ * With -j, frames are rendered by up to `jobs` worker processes. One fast pass runs only the
+ * packets (messages & ticks, no pixels) and forks a worker at a checkpoint every `beats` beats
+ * (default 64). The fork is the checkpoint: the worker starts from an exact copy of the whole
+ * engine, renders the frames up to the next checkpoint, and writes them at their place in the
+ * output. Workers need an output file, not a pipe. The power limiter's scale follows the frames
+ * before it, so with CMD_POWER in the capture each worker is forked enough frames early to
+ * compose those (without writing them) first.
+ *
+ * With -p, rendering runs as a pipeline of four processes, joined by lock-free rings of `depth`
+ * slots in shared memory. Ingest decodes the packets into batches that end at a frame. The
+ * engine plays each batch (messages & ticks) and, for each frame, copies the state compose reads
+ * into the next ring: the effect heap & stacks, clock, parameters, palette & layout, about 10 KB.
+ * The compose process loads each state & composes the frame, and the output process encodes &
+ * writes the frames. It works on pipes too, e.g. for streaming raw frames. At the end each stage
+ * reports how often it waited on its neighbours: the stage that waited least is the one bounding
+ * throughput. The output also reports how long frames took from ingest to output, in us & in
+ * frames still in flight behind them.
+ *
+ * Built with -DTRACE, `-t trace.json` follows every packet to the output (see tracing in
+ * bespeckle.h), writes a Chrome trace / Perfetto timeline of them, and prints the latency
+ * histograms. A frame counts as handed off once it is in the write buffer. Serial renders only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "bespeckle.c"
+#include "effects.c"
+
+#define PACKET_SIZE  (2 + CAN_DATA_SIZE)
+#define WRITE_BUFFER (1 << 20)
+
+#define FORMAT_PPM   0
+#define FORMAT_RAW   1
+
+uint8_t write_buffer[WRITE_BUFFER];
+size_t write_used = 0;
+FILE* out;
+
+// Workers write at this offset in the output instead of appending; -1 to append
+off_t write_offset = -1;
+
+void flush_output(){
+    if(write_offset >= 0){
+        if(write_used && pwrite(fileno(out), write_buffer, write_used, write_offset) != (ssize_t) write_used){
+            perror("render: pwrite");
+            exit(1);
+        }
+        write_offset += write_used;
+    }else if(write_used && fwrite(write_buffer, 1, write_used, out) != write_used){
+        perror("render: write");
+        exit(1);
+    }
+    write_used = 0;
+}
+
+void write_frame(const rgb_t* strip){
+    rgba_t color;
+    uint16_t i;
+    if(write_used + 3 * PHYSICAL_LENGTH > WRITE_BUFFER){
+        flush_output();
+    }
+    for(i = 0; i < PHYSICAL_LENGTH; i++){
+        color = unpack_rgb(strip[i]);
+        write_buffer[write_used++] = color.r;
+        write_buffer[write_used++] = color.g;
+        write_buffer[write_used++] = color.b;
+    }
+}
+
+uint8_t* read_capture(const char* path, size_t* len){
+    // The whole capture, so frames can be counted before writing the ppm header
+    FILE* in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    uint8_t* buf = NULL;
+    size_t size = 0;
+    size_t n;
+
+    if(in == NULL){
+        perror(path);
+        exit(1);
+    }
+    *len = 0;
+    do{
+        if(*len == size){
+            size = size ? size * 2 : (1 << 16);
+            buf = realloc(buf, size);
+            if(buf == NULL){
+                perror("render: realloc");
+                exit(1);
+            }
+        }
+        n = fread(buf + *len, 1, size - *len, in);
+        *len += n;
+    }while(n);
+    if(in != stdin){
+        fclose(in);
+    }
+    return buf;
+}
+
+bool_t is_frame(const uint8_t* p){
+    return p[0] == CMD_SYNC || p[0] == CMD_TICK;
+}
+
+void decode(const uint8_t* p, canpacket_t* packet){
+    packet->cmd = p[0];
+    packet->uid = p[1];
+    memcpy(packet->data, p + 2, CAN_DATA_SIZE);
+}
+
+bool_t play(const uint8_t* p){
+    // Apply one captured packet; true if a frame follows it
+    canpacket_t packet;
+    decode(p, &packet);
+    message(&packet);
+    return is_frame(p);
+}
+
+uint64_t now_us(){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+#ifdef TRACE
+FILE* trace_out = NULL;
+uint64_t trace_epoch;
+bool_t trace_first = 1;
+
+uint32_t trace_now(){
+    return now_us() - trace_epoch;
+}
+
+uint64_t trace_unwrap(uint32_t stamp, uint64_t now){
+    // The trace clock wraps after about 71 minutes; a stamp is never that old, so count back
+    // from `now` (us since trace_epoch) to place it on the whole timeline
+    return now - (uint32_t) ((uint32_t) now - stamp);
+}
+
+void trace_event(const char* name, uint8_t tid, const TraceSpan* span, uint64_t from, uint64_t to){
+    fprintf(trace_out, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %llu, \"dur\": %llu, "
+            "\"args\": {\"cmd\": %d, \"uid\": %d}}", trace_first ? "[" : ",", name, tid, (unsigned long long) from,
+            (unsigned long long) (to - from), span->cmd, span->uid);
+    trace_first = 0;
+}
+
+void trace_json(const TraceSpan* span){
+    // One track per stage
+    uint64_t now = now_us() - trace_epoch;
+    uint64_t ingest = trace_unwrap(span->ingest, now);
+    uint64_t applied = trace_unwrap(span->applied, now);
+    uint64_t composed = trace_unwrap(span->composed, now);
+    uint64_t output = trace_unwrap(span->output, now);
+
+    trace_event("apply", 1, span, ingest, applied);
+    trace_event("until composed", 2, span, applied, composed);
+    trace_event("until output", 3, span, composed, output);
+}
+
+void trace_report(){
+    static const char* const stages[TRACE_STAGES] = {"apply", "compose", "output", "total"};
+    uint8_t s;
+    uint8_t b;
+
+    fprintf(stderr, "render: latency histograms, packets per bucket (< 2^b us)\n%8s", "");
+    for(b = 0; b < TRACE_BUCKETS; b++){
+        fprintf(stderr, " %7d", b);
+    }
+    for(s = 0; s < TRACE_STAGES; s++){
+        fprintf(stderr, "\n%8s", stages[s]);
+        for(b = 0; b < TRACE_BUCKETS; b++){
+            fprintf(stderr, " %7u", trace_histogram[s][b]);
+        }
+    }
+    fprintf(stderr, "\nrender: %u packets not traced\n", trace_dropped);
+}
+#endif
+
+void render(const uint8_t* capture, size_t from, size_t start, size_t end){
+    // Play packets [from, end), composing a frame after each sync & tick; those from `start` on
+    // are written
+    rgb_t strip[PHYSICAL_LENGTH];
+    size_t pos;
+    for(pos = from; pos < end; pos += PACKET_SIZE){
+        if(play(capture + pos)){
+            populate_strip(strip);
+            if(pos < start){
+                continue;
+            }
+            write_frame(strip);
+#ifdef TRACE
+            trace_output();
+#endif
+        }
+    }
+    flush_output();
+}
+
+size_t next_checkpoint(const uint8_t* capture, size_t len, size_t start, unsigned beats){
+    // The checkpoint after `start` is just before its `beats`-th tick
+    size_t pos;
+    unsigned ticks = 0;
+    for(pos = start + PACKET_SIZE; pos < len; pos += PACKET_SIZE){
+        if(capture[pos] == CMD_TICK && ++ticks == beats){
+            return pos;
+        }
+    }
+    return len;
+}
+
+unsigned power_warmup(const uint8_t* capture, size_t len){
+    // Frames to compose before the first written one so power_scale is the same as in sequence
+    // The scale climbs back from anywhere to POWER_FULL in that many frames, at the slowest rate
+    unsigned frames = 0;
+    unsigned rate;
+    size_t pos;
+    for(pos = 0; pos < len; pos += PACKET_SIZE){
+        if(capture[pos] == CMD_POWER){
+            rate = capture[pos + 4] ? capture[pos + 4] : POWER_RELEASE;
+            if((POWER_FULL + rate - 1) / rate > frames){
+                frames = (POWER_FULL + rate - 1) / rate;
+            }
+        }
+    }
+    return frames;
+}
+
+size_t warmup_start(const uint8_t* capture, size_t start, unsigned frames){
+    // Where to start playing to compose `frames` frames before `start`
+    size_t pos = start;
+    while(frames && pos){
+        pos -= PACKET_SIZE;
+        if(is_frame(capture + pos)){
+            frames--;
+        }
+    }
+    return pos;
+}
+
+int render_parallel(const uint8_t* capture, size_t len, off_t header, int jobs, unsigned beats){
+    unsigned warmup = power_warmup(capture, len);
+    size_t start;
+    size_t end;
+    size_t from;
+    size_t next;
+    size_t pos = 0;
+    off_t offset = header;
+    int running = 0;
+    int failed = 0;
+    int status;
+    pid_t pid;
+
+    for(start = 0; start < len; start = end){
+        end = next_checkpoint(capture, len, start, beats);
+        from = warmup_start(capture, start, warmup);
+        // Advance the engine to where the worker starts
+        for(; pos < from; pos += PACKET_SIZE){
+            play(capture + pos);
+        }
+        if(running == jobs){
+            wait(&status);
+            failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+            running--;
+        }
+        pid = fork();
+        if(pid < 0){
+            perror("render: fork");
+            return 1;
+        }
+        if(pid == 0){
+            write_offset = offset;
+            render(capture, from, start, end);
+            _exit(0);
+        }
+        running++;
+        for(next = start; next < end; next += PACKET_SIZE){
+            if(is_frame(capture + next)){
+                offset += 3 * PHYSICAL_LENGTH;
+            }
+        }
+    }
+    while(running--){
+        wait(&status);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+    return failed;
+}
+
+/* Pipeline
+ * Stages hand work to the next one through rings of fixed size slots in shared memory.
+ * Single producer, single consumer: item n is in slot n % depth.
+ */
+typedef struct {
+    atomic_ulong head; // Items pushed
+    atomic_ulong tail; // Items taken
+    atomic_int done;
+    unsigned long depth;
+    size_t slot_size;
+    uint8_t slots[];
+} Ring;
+
+void* shared_alloc(size_t size){
+    // Memory every stage forked after this sees
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED){
+        perror("render: mmap");
+        exit(1);
+    }
+    return mem;
+}
+
+Ring* ring_create(unsigned long depth, size_t slot_size){
+    Ring* ring = shared_alloc(sizeof(Ring) + depth * slot_size);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->done, 0);
+    ring->depth = depth;
+    ring->slot_size = slot_size;
+    return ring;
+}
+
+void* ring_next_free(Ring* ring, unsigned long* waits){
+    // The slot to fill next, once the consumer has emptied it
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == ring->depth){
+        (*waits)++;
+        sched_yield();
+    }
+    return ring->slots + (head % ring->depth) * ring->slot_size;
+}
+
+void ring_push(Ring* ring){
+    atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+}
+
+void* ring_next_full(Ring* ring, unsigned long* waits){
+    // The slot to take next; NULL once the producer is done & the ring is empty
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while(tail == atomic_load_explicit(&ring->head, memory_order_acquire)){
+        // The producer sets done after its last push, so look at head again once it is set
+        if(atomic_load_explicit(&ring->done, memory_order_acquire) &&
+           tail == atomic_load_explicit(&ring->head, memory_order_acquire)){
+            return NULL;
+        }
+        (*waits)++;
+        sched_yield();
+    }
+    return ring->slots + (tail % ring->depth) * ring->slot_size;
+}
+
+void ring_pop(Ring* ring){
+    atomic_fetch_add_explicit(&ring->tail, 1, memory_order_release);
+}
+
+void ring_close(Ring* ring){
+    atomic_store_explicit(&ring->done, 1, memory_order_release);
+}
+
+// Packets up to the next frame, or BATCH_PACKETS of them if there are more
+#define BATCH_PACKETS 64
+
+typedef struct {
+    canpacket_t packets[BATCH_PACKETS];
+    uint16_t count;
+    bool_t frame;          // A frame follows the last packet
+    unsigned long index;   // Of that frame
+    uint64_t ingested;
+} PacketBatch;
+
+// Everything compose reads, as the engine left it after the packets before a frame
+// The stages are forks of one process, so the pointers inside the effects stay valid
+// power_scale follows the composed frames, so it lives in the compose stage, which sees them all
+typedef struct {
+    Effect heap[EFFECTS_HEAP_SIZE];
+    EffectStack sources[NUM_SOURCES];
+    EffectStack groups[NUM_GROUPS];
+    tick_t clock;
+    uint8_t parameters[PARAM_LEN];
+    rgba_t palette[PALETTE_SIZE];
+    uint32_t palette_generation;
+    uint16_t power_budget;
+    uint8_t power_release;
+    uint8_t layout;
+    uint8_t layout_param;
+    uint8_t effects_running;
+    unsigned long index;   // Which frame, & when its last packet was ingested
+    uint64_t ingested;
+} EngineState;
+
+// A frame in flight between compose & output
+typedef struct {
+    rgb_t strip[PHYSICAL_LENGTH];
+    unsigned long index;
+    uint64_t ingested;
+} PipelineFrame;
+
+void save_state(EngineState* state){
+    uint8_t i;
+    memcpy(state->heap, effects_heap, sizeof(effects_heap));
+    for(i = 0; i < NUM_SOURCES; i++){
+        state->sources[i] = *source_stack(i);
+    }
+    for(i = 0; i < NUM_GROUPS; i++){
+        state->groups[i] = groups[i].effects;
+    }
+    state->clock = clock;
+    memcpy(state->parameters, parameters, PARAM_LEN);
+    memcpy(state->palette, palette, sizeof(palette));
+    state->palette_generation = palette_generation;
+    state->power_budget = power_budget;
+    state->power_release = power_release;
+    state->layout = layout;
+    state->layout_param = layout_param;
+    state->effects_running = effects_running;
+}
+
+void load_state(const EngineState* state){
+    // The group buffers stay with the compose stage, so they are still cached across frames
+    uint8_t i;
+    memcpy(effects_heap, state->heap, sizeof(effects_heap));
+    for(i = 0; i < NUM_SOURCES; i++){
+        *source_stack(i) = state->sources[i];
+    }
+    for(i = 0; i < NUM_GROUPS; i++){
+        groups[i].effects = state->groups[i];
+    }
+    clock = state->clock;
+    memcpy(parameters, state->parameters, PARAM_LEN);
+    memcpy(palette, state->palette, sizeof(palette));
+    palette_generation = state->palette_generation;
+    power_budget = state->power_budget;
+    power_release = state->power_release;
+    if(state->layout != layout || state->layout_param != layout_param){
+        set_layout(state->layout, state->layout_param);
+    }
+    effects_running = state->effects_running;
+}
+
+void compose_stage(Ring* states, Ring* frames){
+    const EngineState* state;
+    PipelineFrame* frame;
+    unsigned long waits_in = 0;
+    unsigned long waits_out = 0;
+
+    while((state = ring_next_full(states, &waits_in))){
+        load_state(state);
+        frame = ring_next_free(frames, &waits_out);
+        frame->index = state->index;
+        frame->ingested = state->ingested;
+        ring_pop(states);
+        populate_strip(frame->strip);
+        ring_push(frames);
+    }
+    ring_close(frames);
+    fprintf(stderr, "render: compose waited %lu times for the engine, %lu times for the output\n",
+            waits_in, waits_out);
+}
+
+void ingest_stage(const uint8_t* capture, size_t len, Ring* batches, atomic_ulong* ingested){
+    // Decode the packets & cut them into batches at every frame
+    PacketBatch* batch = NULL;
+    unsigned long frames = 0;
+    unsigned long waits = 0;
+    size_t pos;
+
+    for(pos = 0; pos < len; pos += PACKET_SIZE){
+        if(batch == NULL){
+            batch = ring_next_free(batches, &waits);
+            batch->count = 0;
+        }
+        decode(capture + pos, batch->packets + batch->count++);
+        batch->frame = is_frame(capture + pos);
+        if(batch->frame || batch->count == BATCH_PACKETS){
+            batch->index = frames;
+            batch->ingested = now_us();
+            ring_push(batches);
+            if(batch->frame){
+                atomic_store_explicit(ingested, ++frames, memory_order_relaxed);
+            }
+            batch = NULL;
+        }
+    }
+    if(batch){
+        ring_push(batches);
+    }
+    ring_close(batches);
+    fprintf(stderr, "render: ingest waited %lu times\n", waits);
+}
+
+void output_stage(Ring* frames, atomic_ulong* ingested){
+    // Latency runs from a frame's last packet being ingested to it being written; the frames
+    // in flight are the ones ingested but not yet written, as this one is
+    const PipelineFrame* frame;
+    unsigned long count = 0;
+    unsigned long waits = 0;
+    unsigned long flight;
+    unsigned long flight_total = 0;
+    unsigned long flight_worst = 0;
+    uint64_t latency;
+    uint64_t total = 0;
+    uint64_t worst = 0;
+
+    while((frame = ring_next_full(frames, &waits))){
+        write_frame(frame->strip);
+        latency = now_us() - frame->ingested;
+        total += latency;
+        worst = latency > worst ? latency : worst;
+        flight = atomic_load_explicit(ingested, memory_order_relaxed) - frame->index;
+        flight_total += flight;
+        flight_worst = flight > flight_worst ? flight : flight_worst;
+        count++;
+        ring_pop(frames);
+    }
+    flush_output();
+    fflush(out);
+    fprintf(stderr, "render: output waited %lu times\n", waits);
+    fprintf(stderr, "render: ingest to output took %.1f us / %.1f frames on average, %lu us / %lu frames at most\n",
+            count ? (double) total / count : 0.0, count ? (double) flight_total / count : 0.0,
+            (unsigned long) worst, flight_worst);
+}
+
+int render_pipelined(const uint8_t* capture, size_t len, unsigned long depth){
+    Ring* batches = ring_create(depth, sizeof(PacketBatch));
+    Ring* states = ring_create(depth, sizeof(EngineState));
+    Ring* frames = ring_create(depth, sizeof(PipelineFrame));
+    atomic_ulong* ingested = shared_alloc(sizeof(atomic_ulong));
+    const PacketBatch* batch;
+    EngineState* state;
+    unsigned long waits_in = 0;
+    unsigned long waits_out = 0;
+    int failed = 0;
+    int status;
+    pid_t ingest;
+    pid_t compose;
+    pid_t output;
+
+    atomic_init(ingested, 0);
+    output = fork();
+    if(output == 0){
+        output_stage(frames, ingested);
+        _exit(0);
+    }
+    compose = output < 0 ? -1 : fork();
+    if(compose == 0){
+        compose_stage(states, frames);
+        _exit(0);
+    }
+    ingest = compose < 0 ? -1 : fork();
+    if(ingest == 0){
+        ingest_stage(capture, len, batches, ingested);
+        _exit(0);
+    }
+    if(output < 0 || compose < 0 || ingest < 0){
+        perror("render: fork");
+        return 1;
+    }
+
+    // The engine stage: messages & ticks, then hand the state on for each frame
+    while((batch = ring_next_full(batches, &waits_in))){
+        // Each batch ends at a frame, so message_batch may skip ticks inside it
+        message_batch((canpacket_t*) batch->packets, batch->count);
+        if(batch->frame){
+            state = ring_next_free(states, &waits_out);
+            save_state(state);
+            state->index = batch->index;
+            state->ingested = batch->ingested;
+            ring_push(states);
+        }
+        ring_pop(batches);
+    }
+    ring_close(states);
+    fprintf(stderr, "render: engine waited %lu times for ingest, %lu times for compose\n", waits_in, waits_out);
+
+    waitpid(ingest, &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+    waitpid(compose, &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+    waitpid(output, &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+    munmap(batches, sizeof(Ring) + depth * sizeof(PacketBatch));
+    munmap(states, sizeof(Ring) + depth * sizeof(EngineState));
+    munmap(frames, sizeof(Ring) + depth * sizeof(PipelineFrame));
+    munmap(ingested, sizeof(atomic_ulong));
+    return failed;
+}
+
+int main(int argc, char** argv){
+    uint8_t* capture;
+    size_t len;
+    size_t pos;
+    unsigned long frames = 0;
+    int format = FORMAT_PPM;
+    int jobs = 1;
+    unsigned beats = 64;
+    unsigned long depth = 0;
+    int failed = 0;
+
+    for(; argc >= 5 && argv[1][0] == '-' && argv[1][1]; argv += 2, argc -= 2){
+        if(strcmp(argv[1], "-f") == 0 && strcmp(argv[2], "raw") == 0){
+            format = FORMAT_RAW;
+        }else if(strcmp(argv[1], "-f") == 0 && strcmp(argv[2], "ppm") == 0){
+            format = FORMAT_PPM;
+        }else if(strcmp(argv[1], "-j") == 0 && atoi(argv[2]) > 0){
+            jobs = atoi(argv[2]);
+        }else if(strcmp(argv[1], "-c") == 0 && atoi(argv[2]) > 0){
+            beats = atoi(argv[2]);
+        }else if(strcmp(argv[1], "-p") == 0 && atoi(argv[2]) > 0){
+            depth = atoi(argv[2]);
+#ifdef TRACE
+        }else if(strcmp(argv[1], "-t") == 0){
+            trace_out = fopen(argv[2], "w");
+            if(trace_out == NULL){
+                perror(argv[2]);
+                return 1;
+            }
+#endif
+        }else{
+            fprintf(stderr, "render: bad option %s %s\n", argv[1], argv[2]);
+            return 1;
+        }
+    }
+    if(argc != 3){
+        fprintf(stderr, "usage: %s [-f ppm|raw] [-j jobs] [-c beats] [-p depth] [-t trace.json] capture.bin out\n", argv[0]);
+        return 1;
+    }
+
+    capture = read_capture(argv[1], &len);
+    len -= len % PACKET_SIZE;
+    for(pos = 0; pos < len; pos += PACKET_SIZE){
+        if(is_frame(capture + pos)){
+            frames++;
+        }
+    }
+
+    out = strcmp(argv[2], "-") ? fopen(argv[2], "wb") : stdout;
+    if(out == NULL){
+        perror(argv[2]);
+        return 1;
+    }
+    if(format == FORMAT_PPM){
+        write_used = sprintf((char*) write_buffer, "P6\n%d %lu\n255\n", PHYSICAL_LENGTH, frames);
+    }
+
+    init_effects_heap();
+#ifdef TRACE
+    if(trace_out && (depth || jobs > 1)){
+        fprintf(stderr, "render: -t only traces serial renders\n");
+        return 1;
+    }
+    if(trace_out){
+        trace_epoch = now_us();
+        trace_clock = trace_now;
+        trace_sink = trace_json;
+    }
+#endif
+    if(depth){
+        // The output process inherits the header in write_buffer
+        failed = render_pipelined(capture, len, depth);
+    }else if(jobs > 1 && out != stdout){
+        // The header goes first; workers write around it
+        flush_output();
+        fflush(out);
+        failed = render_parallel(capture, len, ftello(out), jobs, beats);
+    }else{
+        render(capture, 0, 0, len);
+    }
+    if(out != stdout){
+        fclose(out);
+    }
+#ifdef TRACE
+    if(trace_out){
+        fprintf(trace_out, "%s\n]\n", trace_first ? "[" : "");
+        fclose(trace_out);
+        trace_report();
+    }
+#endif
+    if(failed){
+        fprintf(stderr, "render: a worker failed\n");
+        return 1;
+    }
+    fprintf(stderr, "render: %lu frames\n", frames);
+    free(capture);
+    return 0;
+}
@@ -18,23 +18,426 @@ void stack_length(Effect * eff){
 
 void print_strip(){
     int i;
-    rgb_t strip[STRIP_LENGTH];
-    compose_all(effects, strip);        
-    for(i = 0; i < STRIP_LENGTH; i++){
+    rgb_t strip[PHYSICAL_LENGTH];
+    compose_all(effects.head, strip);        
+    for(i = 0; i < PHYSICAL_LENGTH; i++){
         print_color(strip[i]);
     }
 }
+char* append(char* p, const char* s){
+    while(*s){
+        *p++ = *s++;
+    }
+    return p;
+}
+
+char* append_hex(char* p, uint8_t x){
+    static const char digits[] = "0123456789abcdef";
+    *p++ = digits[x >> 4];
+    *p++ = digits[x & 0xf];
+    return p;
+}
+
 void print_strip_html(){
+    // Formats the frame into one buffer; a few printf calls per pixel made this the slow part
     int i;
-    rgb_t strip[STRIP_LENGTH];
-    compose_all(effects, strip);        
-    printf("<div>\n");
-    for(i = 0; i < STRIP_LENGTH; i++){
-        printf("\t<span style='background-color:");
-        print_color(strip[i]);
-        printf("'>%d</span>\n", i);
+    rgb_t strip[PHYSICAL_LENGTH];
+    rgba_t color;
+    char buf[16 + PHYSICAL_LENGTH * 64];
+    char* p = buf;
+    compose_all(effects.head, strip);        
+    p = append(p, "<div>\n");
+    for(i = 0; i < PHYSICAL_LENGTH; i++){
+        color = unpack_rgb(strip[i]);
+        p = append(p, "\t<span style='background-color:#");
+        p = append_hex(p, color.r);
+        p = append_hex(p, color.g);
+        p = append_hex(p, color.b);
+        p = append(p, " '>");
+        p += sprintf(p, "%d", i);
+        p = append(p, "</span>\n");
+    }
+    p = append(p, "</div>\n");
+    fwrite(buf, 1, p - buf, stdout);
+}
+
+// div_recip must equal n / d for every divisor the effects set up, for quotients up to 255
+// The estimate never decreases as n grows, so checking both ends of each quotient covers the rest
+int check_divisor(uint32_t d){
+    uint32_t r = recip(d);
+    uint32_t q;
+    for(q = 0; q < 256; q++){
+        if(div_recip(q * d, d, r) != q || div_recip(q * d + d - 1, d, r) != q){
+            fprintf(stderr, "div_recip(%u, %u) != %u\n", q * d, d, q);
+            return 0;
+        }
     }
-    printf("</div>\n");
+    return 1;
+}
+
+int check_recip(){
+    uint32_t d;
+    // Pulse periods: STRIP_LENGTH * rate
+    for(d = 0; d < 8; d++){
+        if(!check_divisor(STRIP_LENGTH << d)){
+            return 0;
+        }
+    }
+    // Timeout durations, in fracticks
+    for(d = 1; d <= 0x7f * TICK_LENGTH + 0xff; d++){
+        if(!check_divisor(d)){
+            return 0;
+        }
+    }
+    return check_divisor(STRIP_LENGTH);
+}
+
+// The pulse & timeout math as it was with division, before div_recip; the effects must leave
+// exactly the same data as these after every tick & prepare
+bool_t _tick_pulse_div(Effect* eff, fractick_t ft){
+    edata_rgba1_char4_int6 *edata = (edata_rgba1_char4_int6 *) eff->data;
+    uint8_t rate = 1 << (edata->xs[1] & 0x7);
+    uint8_t mv;
+    if(ft == 0){
+        mv = (0xff << 3) / (STRIP_LENGTH * rate);
+        if(edata->xs[1] & 0x8){
+            edata->ys[2] <<= mv;
+            edata->ys[2] |= (edata->ys[3] >> (32 - mv));
+            edata->ys[3] <<= mv;
+        }else{
+            edata->ys[3] >>= mv;
+            edata->ys[3] |= (edata->ys[2] << (32 - mv));
+            edata->ys[2] >>= mv;
+        }
+        edata->ys[0] = edata->ys[2];
+        edata->ys[1] = edata->ys[3];
+        edata->xs[2] = ((uint32_t) edata->cs[0].a * (0xff % (STRIP_LENGTH * rate)) / (STRIP_LENGTH * rate));
+    }else{
+        mv = ((uint16_t) ft << 3) / (STRIP_LENGTH * rate);
+        if(edata->xs[1] & 0x8){
+            edata->ys[0] = edata->ys[2] << mv;
+            edata->ys[1] = edata->ys[3] << mv;
+            if(mv > 0){
+                edata->ys[0] |= (edata->ys[3] >> (32 - mv));
+            }
+        }else{
+            edata->ys[0] = edata->ys[2] >> mv;
+            edata->ys[1] = edata->ys[3] >> mv;
+            if(mv > 0){
+                edata->ys[1] |= (edata->ys[2] << (32 - mv));
+            }
+        }
+        edata->xs[2] = ((uint32_t) edata->cs[0].a * (ft % (STRIP_LENGTH * rate)) / (STRIP_LENGTH * rate));
+    }
+    return CONTINUE;
+}
+
+bool_t _tick_fadeacross_div(Effect* eff, fractick_t ft){
+    edata_rgba1_char4_int6 *edata = (edata_rgba1_char4_int6 *) eff->data;
+    uint8_t rate = 1 << (edata->xs[1] & 0x7);
+    uint8_t l;
+    if(ft == 0){
+        l = ((240 << 3) / (STRIP_LENGTH * rate));
+        if(edata->xs[1] & 0x8){
+            for(; l; l--){
+                edata->ys[2] = edata->ys[2] | (edata->ys[2] << 1) | (edata->ys[3] >> 31);
+                edata->ys[3] = edata->ys[3] | (edata->ys[3] << 1);
+            }
+        }else{
+            for(; l; l--){
+                edata->ys[3] = edata->ys[3] | (edata->ys[3] >> 1) | (edata->ys[2] << 31);
+                edata->ys[2] = edata->ys[2] | (edata->ys[2] >> 1);
+            }
+        }
+        edata->ys[0] = edata->ys[2];
+        edata->ys[1] = edata->ys[3];
+    }else{
+        l = ((uint16_t) ft << 3) / (STRIP_LENGTH * rate);
+        edata->ys[0] = edata->ys[2];
+        edata->ys[1] = edata->ys[3];
+        if(edata->xs[1] & 0x8){
+            for(; l; l--){
+                edata->ys[0] = edata->ys[0] | (edata->ys[0] << 1) | (edata->ys[1] >> 31);
+                edata->ys[1] = edata->ys[1] | (edata->ys[1] << 1);
+            }
+        }else{
+            for(; l; l--){
+                edata->ys[1] = edata->ys[1] | (edata->ys[1] >> 1) | (edata->ys[0] << 31);
+                edata->ys[0] = edata->ys[0] | (edata->ys[0] >> 1);
+            }
+        }
+        edata->xs[2] = (((uint32_t) edata->cs[0].a * ((rate * ft) % STRIP_LENGTH)) / STRIP_LENGTH);
+        edata->xs[3] = edata->cs[0].a - edata->xs[2];
+    }
+    return CONTINUE;
+}
+
+void _prepare_timeout_scroll_div(Effect* eff, tick_t now){
+    edata_rgba1_char4_time1_int2_char8 *edata = (edata_rgba1_char4_time1_int2_char8 *) eff->data;
+    int32_t time_left = time_sub(edata->ts[0], now);
+    int32_t time_total = (edata->xs[0] & 0x7f) * TICK_LENGTH + edata->xs[1];
+    int32_t t;
+
+    if(time_left < 0 || time_total == 0){
+        edata->xs[3] = (edata->xs[0] & 0x80) ? 0 : 0xff;
+        _prepare_er_pulse(eff);
+        return;
+    }
+    if(time_left > time_total){
+        time_left = time_total;
+    }
+    t = (edata->xs[0] & 0x80) ? time_left : time_total - time_left;
+    edata->xs[3] = (t * STRIP_LENGTH) / time_total;
+    if(effects_running < EFFECTS_SLOWDOWN){
+        edata->xs[2] = (((t * STRIP_LENGTH) % time_total) * edata->cs[0].a) / time_total;
+    }else{
+        edata->xs[2] = edata->cs[0].a;
+    }
+    if(edata->xs[2] < 1){
+        edata->xs[2] = 1;
+    }
+    _prepare_er_pulse(eff);
+}
+
+void _prepare_timeout_fade_div(Effect* eff, tick_t now){
+    edata_rgba1_char4_time1_int2 *edata = (edata_rgba1_char4_time1_int2 *) eff->data;
+    int32_t time_left = time_sub(edata->ts[0], now);
+    int32_t time_total = (edata->xs[0] & 0x7f) * TICK_LENGTH + edata->xs[1];
+    int32_t t;
+
+    if(time_left < 0 || time_total == 0){
+        edata->cs[0].a = (edata->xs[0] & 0x80) ? 0 : edata->xs[2];
+        return;
+    }
+    if(time_left > time_total){
+        time_left = time_total;
+    }
+    t = (edata->xs[0] & 0x80) ? time_left : time_total - time_left;
+    edata->cs[0].a = (t * edata->xs[2]) / time_total;
+}
+
+// Every rate & direction with every fractick, for a few alphas; every duration & direction
+// from a few fractick lengths, at ~100 times across each
+int check_recip_effects(){
+    static const uint8_t alphas[] = {0x00, 0x01, 0x7f, 0xfe, 0xff};
+    static const uint8_t fracs[] = {0, 1, 7, 120, 239, 255};
+    static const uint8_t pulses[] = {0x14, 0x16};
+    static const uint8_t timeouts[] = {0x41, 0x42, 0x43};
+    canpacket_t create = {0, 'r', {0x20, 0x40, 0x60, 0, 0, 0}};
+    canpacket_t reset = {CMD_RESET, 0, {0, 0, 0, 0, 0, 0}};
+    Effect* eff;
+    Effect old;
+    tick_t now;
+    int32_t total;
+    int32_t k;
+    uint16_t e, a, x, f, ft;
+
+    init_effects_heap();
+    for(e = 0; e < sizeof(pulses); e++){
+        for(x = 0; x < 16; x++){
+            for(a = 0; a < sizeof(alphas); a++){
+                create.cmd = pulses[e];
+                create.data[3] = alphas[a];
+                create.data[5] = x;
+                message(&create);
+                eff = find_effect(&effects, 'r');
+                for(ft = 0; ft < 256; ft++){
+                    old = *eff;
+                    effect_tick(eff, ft);
+                    if(pulses[e] == 0x14){
+                        _tick_pulse_div(&old, ft);
+                    }else{
+                        _tick_fadeacross_div(&old, ft);
+                    }
+                    if(memcmp(eff->data, old.data, eff->table->size)){
+                        fprintf(stderr, "effect %02x rate %02x alpha %02x differs from division at ft %d\n", pulses[e], x, alphas[a], ft);
+                        return 0;
+                    }
+                }
+            }
+        }
+    }
+    for(e = 0; e < sizeof(timeouts); e++){
+        for(x = 0; x < 256; x++){
+            for(f = 0; f < sizeof(fracs); f++){
+                for(a = 0; a < sizeof(alphas); a++){
+                    create.cmd = timeouts[e];
+                    create.data[3] = alphas[a];
+                    create.data[4] = x;
+                    create.data[5] = fracs[f];
+                    message(&create);
+                    eff = find_effect(&effects, 'r');
+                    total = (x & 0x7f) * TICK_LENGTH + fracs[f];
+                    for(k = 0; k <= total + TICK_LENGTH; k += total / 97 + 1){
+                        now = eff->start;
+                        time_add(&now, k / TICK_LENGTH, k % TICK_LENGTH);
+                        old = *eff;
+                        effect_prepare(eff, now);
+                        if(timeouts[e] == 0x43){
+                            _prepare_timeout_fade_div(&old, now);
+                        }else{
+                            _prepare_timeout_scroll_div(&old, now);
+                        }
+                        if(memcmp(eff->data, old.data, eff->table->size)){
+                            fprintf(stderr, "effect %02x duration %02x.%02x alpha %02x differs from division at %d\n", timeouts[e], x, fracs[f], alphas[a], k);
+                            return 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    message(&reset);
+    return 1;
+}
+
+// A fragment transfer open across snapshot_restore must not give back a slot the restore reused
+int check_restore_frag(){
+    static uint8_t buf[SNAPSHOT_MAX_SIZE];
+    canpacket_t a = {0x10, 'a', {0xff, 0x00, 0x00, 0xff, 0x00, 0x00}};
+    canpacket_t b = {0x10, 'b', {0x00, 0xff, 0x00, 0xff, 0x00, 0x00}};
+    canpacket_t frag = {CMD_FRAG, 'c', {0, 0, 0, 0, 0, 0}};
+    canpacket_t reset = {CMD_RESET, 0, {0, 0, 0, 0, 0, 0}};
+    uint16_t len;
+    Effect* eff;
+    int n = 0;
+
+    init_effects_heap();
+    message(&a);
+    message(&b);
+    len = snapshot_save(buf, sizeof(buf));
+    message(&reset);
+    message(&a);
+    // Takes the slot `b` is restored into
+    message(&frag);
+    if(snapshot_restore(buf, len) != SNAPSHOT_OK){
+        fprintf(stderr, "snapshot_restore failed\n");
+        return 0;
+    }
+    for(eff = effects.head; eff && eff != (Effect*) EFFECT_UNUSED; eff = eff->next){
+        n++;
+    }
+    if(eff || n != 2 || effects_running != 2){
+        fprintf(stderr, "snapshot_restore lost an effect to a fragment transfer\n");
+        return 0;
+    }
+    message(&reset);
+    return 1;
+}
+
+// One source recording a scene must not capture another source's packets
+int check_source_recording(){
+    canpacket_t record = {CMD_SCENE, 0, {SCENE_RECORD, 0, 0, 0, 0, 0}};
+    canpacket_t end = {CMD_SCENE, 0, {SCENE_END, 0, 0, 0, 0, 0}};
+    canpacket_t a = {0x10, 'a', {0xff, 0x00, 0x00, 0xff, 0x00, 0x00}};
+    canpacket_t b = {0x10, 'b', {0x00, 0xff, 0x00, 0xff, 0x00, 0x00}};
+    canpacket_t reset = {CMD_RESET, 0, {0, 0, 0, 0, 0, 0}};
+    int ok;
+
+    init_effects_heap();
+    message_from(1, &record);
+    message_from(0, &a);
+    message_from(1, &b);
+    message_from(1, &end);
+    ok = find_effect(&effects, 'a') && !find_effect(source_stack(1), 'b') &&
+         scenes[0].count == 1 && scenes[0].packets[0].uid == 'b';
+    if(!ok){
+        fprintf(stderr, "scene recording captured another source's packets\n");
+    }
+    scenes[0].count = 0;
+    message(&reset);
+    return ok;
+}
+
+// A snapshot with two effects of one uid in a stack, or an unknown layout, must change nothing
+int check_restore_invalid(){
+    static uint8_t buf[SNAPSHOT_MAX_SIZE];
+    static uint8_t before[SNAPSHOT_MAX_SIZE];
+    static uint8_t after[SNAPSHOT_MAX_SIZE];
+    canpacket_t a = {0x10, 'a', {0xff, 0x00, 0x00, 0xff, 0x00, 0x00}};
+    canpacket_t b = {0x10, 'b', {0x00, 0xff, 0x00, 0xff, 0x00, 0x00}};
+    canpacket_t reset = {CMD_RESET, 0, {0, 0, 0, 0, 0, 0}};
+    uint16_t len, sum, t;
+    uint16_t second = SNAPSHOT_HEADER + 1 + 9 + find_effect_table(0x10)->size;
+
+    init_effects_heap();
+    message(&a);
+    message(&b);
+    len = snapshot_save(before, sizeof(before));
+    for(t = 0; t < 2; t++){
+        memcpy(buf, before, len);
+        if(t){
+            buf[10 + PARAM_LEN] = NUM_LAYOUTS;
+        }else{
+            buf[second + 1] = 'a';
+        }
+        sum = fletcher16(buf, len - 2);
+        buf[len - 2] = sum & 0xff;
+        buf[len - 1] = sum >> 8;
+        if(snapshot_restore(buf, len) != SNAPSHOT_INVALID || snapshot_save(after, sizeof(after)) != len ||
+           memcmp(before, after, len)){
+            fprintf(stderr, "snapshot_restore took a snapshot with %s\n", t ? "an unknown layout" : "a repeated uid");
+            return 0;
+        }
+    }
+    message(&reset);
+    return 1;
+}
+
+// message_batch must leave the same state as passing each packet to message(), through repeated
+// syncs, syncs at fractick 0, beats that carry a fractick, stopping timeouts & automation
+int check_batch(){
+    static uint8_t before[SNAPSHOT_MAX_SIZE];
+    static uint8_t one[SNAPSHOT_MAX_SIZE];
+    static uint8_t batch[SNAPSHOT_MAX_SIZE];
+    static canpacket_t packets[40];
+    canpacket_t setup[] = {
+        {0x21, 'a', {0xff, 0x00, 0x00, 0xff, 0x00, 0x00}},
+        {0x14, 'b', {0x00, 0xff, 0x00, 0x80, 0x00, 0x0a}},
+        {0x16, 'c', {0x00, 0x00, 0xff, 0xff, 0x00, 0x03}},
+        {CMD_AUTO, 0, {AUTO_BIND, AUTO_EFFECT, 'b', 3, 0, 0}},
+        {CMD_AUTO, 0, {AUTO_KEY, 0, 0, 0, 0x00, CURVE_LINEAR}},
+        {CMD_AUTO, 0, {AUTO_KEY, 6, 0, 0, 0xff, CURVE_EASE}},
+    };
+    canpacket_t timeout = {0x42, 'd', {0xff, 0xff, 0xff, 0xff, 0x01, 0x50}};
+    canpacket_t reset = {CMD_RESET, 0, {0, 0, 0, 0, 0, 0}};
+    uint16_t len, len_one, n, i, k;
+    int run;
+
+    init_effects_heap();
+    for(i = 0; i < sizeof(setup) / sizeof(setup[0]); i++){
+        message(setup + i);
+    }
+    for(run = 0; run < 60; run++){
+        // A run of clock packets, sometimes with a timeout created in it
+        n = 0;
+        for(k = 0; k < 1 + run % 4; k++){
+            packets[n].cmd = CMD_TICK;
+            packets[n++].uid = (run + k) % 3 ? 0 : 37 * k;
+            for(i = 0; i < (run * 7 + k) % 9; i++){
+                packets[n].cmd = CMD_SYNC;
+                packets[n++].uid = (i + run) % 5 == 0 ? 0 : ((i + 1) * 25 + run) % 240;
+            }
+        }
+        if(run % 3 == 2){
+            timeout.data[4] = run % 4;
+            packets[run * 7 % n] = timeout;
+        }
+
+        len = snapshot_save(before, sizeof(before));
+        for(i = 0; i < n; i++){
+            message(packets + i);
+        }
+        len_one = snapshot_save(one, sizeof(one));
+        snapshot_restore(before, len);
+        message_batch(packets, n);
+        if(snapshot_save(batch, sizeof(batch)) != len_one || memcmp(one, batch, len_one)){
+            fprintf(stderr, "message_batch differs from message() in run %d\n", run);
+            return 0;
+        }
+    }
+    message(&reset);
+    return 1;
 }
 
 int main(){ 
@@ -46,6 +449,10 @@ int main(){
     //hsva_t color = {0, 255, 255, 0};
     //printf("<style>div{ width: 500px; height: 10px; margin: 0; }</style>\n\n");
     printf("<style>span{ width: 5; height: 5; margin: 0px; padding: 0px; display: inline-block; }\ndiv{font-size: 0; height: 5px; margin-bottom: 0px;}</style>\n\n");
+    if(!check_recip() || !check_recip_effects() || !check_restore_frag() || !check_restore_invalid() ||
+       !check_source_recording() || !check_batch()){
+        return 1;
+    }
     init_effects_heap();
     message(&msg1);
 